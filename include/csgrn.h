@@ -16,5 +16,13 @@
 #include "csgrn/op_instruction.hpp"
 #include "csgrn/compute_shader.hpp"
 #include "csgrn/csg_parser.hpp"
+#include "csgrn/csg_simplify.hpp"
+#include "csgrn/csg_sop.hpp"
+#include "csgrn/mapped_file.hpp"
+#include "csgrn/bounds.hpp"
+#include "csgrn/bvh.hpp"
+#include "csgrn/csg_program.hpp"
+#include "csgrn/scene_binary.hpp"
+#include "csgrn/program_limits.hpp"
 
 #endif // CSGRN_H
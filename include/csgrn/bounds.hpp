@@ -0,0 +1,113 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include "csgrn/operations.hpp"
+#include "csgrn/primitive.hpp"
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <limits>
+
+// Axis aligned box used while compiling. An empty box has min > max.
+struct aabb {
+  glm::vec3 min = glm::vec3(std::numeric_limits<float>::infinity());
+  glm::vec3 max = glm::vec3(-std::numeric_limits<float>::infinity());
+
+  bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+  void expand(const glm::vec3 &p) {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+  }
+
+  static aabb merge(const aabb &a, const aabb &b) {
+    if (a.empty()) return b;
+    if (b.empty()) return a;
+    return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+  }
+
+  static aabb intersect(const aabb &a, const aabb &b) {
+    aabb r{glm::max(a.min, b.min), glm::min(a.max, b.max)};
+    return r.empty() ? aabb() : r;
+  }
+
+  static bool overlaps(const aabb &a, const aabb &b) {
+    return !intersect(a, b).empty();
+  }
+
+  glm::vec3 center() const { return (min + max) * 0.5f; }
+
+  float surface_area() const {
+    if (empty()) return 0.0f;
+    glm::vec3 d = max - min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+};
+
+// GPU layout of a box, one per BOUNDS instruction (std140: two vec4).
+// min.w is 1 for an empty box, which no ray can hit.
+struct alignas(16) bounds {
+  glm::vec4 min;
+  glm::vec4 max;
+};
+
+inline bounds to_gpu_bounds(const aabb &box) {
+  if (box.empty()) return {glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(0.0f)};
+  return {glm::vec4(box.min, 0.0f), glm::vec4(box.max, 0.0f)};
+}
+
+// World-space box of a unit primitive (see the intersectors in raytracer.glsl)
+// placed by `transform`.
+inline aabb primitive_bounds(primitive_types type, const glm::mat4 &transform) {
+  glm::vec3 half(0.5f);
+  if (type == primitive_types::sphere) half = glm::vec3(1.0f);
+  if (type == primitive_types::cylinder) half = glm::vec3(1.0f, 0.5f, 1.0f);
+
+  aabb box;
+  for (int i = 0; i < 8; ++i) {
+    glm::vec3 corner((i & 1) ? half.x : -half.x, (i & 2) ? half.y : -half.y,
+                     (i & 4) ? half.z : -half.z);
+    box.expand(glm::vec3(transform * glm::vec4(corner, 1.0f)));
+  }
+  return box;
+}
+
+// Conservative box of a Boolean operation given its operands' boxes
+inline aabb operation_bounds(op_types op, const aabb &left, const aabb &right) {
+  switch (op) {
+  case op_types::op_union: return aabb::merge(left, right);
+  case op_types::op_intersection: return aabb::intersect(left, right);
+  case op_types::op_difference: return left;
+  default: return aabb::merge(left, right);
+  }
+}
+
+// Slab test matching hit_bounds() in raytracer.glsl: true if the ray touches
+// the box at some t >= 0.
+inline bool ray_hits_bounds(const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                            const bounds &box) {
+  if (box.min.w != 0.0f) return false;
+  glm::vec3 t0 = (glm::vec3(box.min) - origin) * inv_dir;
+  glm::vec3 t1 = (glm::vec3(box.max) - origin) * inv_dir;
+  glm::vec3 tmin = glm::min(t0, t1);
+  glm::vec3 tmax = glm::max(t0, t1);
+  float t_enter = std::max(std::max(tmin.x, tmin.y), tmin.z);
+  float t_exit = std::min(std::min(tmax.x, tmax.y), tmax.z);
+  return t_enter <= t_exit && t_exit >= 0.0f;
+}
+
+// Entry distance into the box, infinity on a miss. Matches bounds_entry() in
+// raytracer.glsl.
+inline float ray_bounds_entry(const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                              const bounds &box) {
+  if (box.min.w != 0.0f) return std::numeric_limits<float>::infinity();
+  glm::vec3 t0 = (glm::vec3(box.min) - origin) * inv_dir;
+  glm::vec3 t1 = (glm::vec3(box.max) - origin) * inv_dir;
+  glm::vec3 tmin = glm::min(t0, t1);
+  glm::vec3 tmax = glm::max(t0, t1);
+  float t_enter = std::max(std::max(tmin.x, tmin.y), tmin.z);
+  float t_exit = std::min(std::min(tmax.x, tmax.y), tmax.z);
+  if (t_enter > t_exit || t_exit < 0.0f) return std::numeric_limits<float>::infinity();
+  return t_enter;
+}
+
+#endif // BOUNDS_H
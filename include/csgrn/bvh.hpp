@@ -0,0 +1,158 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "csgrn/bounds.hpp"
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+
+// Top-level BVH over the children of the root union. Each leaf is a small
+// union of children with its own instruction range, so the shader can visit
+// leaves front to back and stop at the first hit instead of evaluating the
+// whole union for every pixel.
+
+// Scenes whose root union has fewer children stay on the plain stream
+constexpr size_t BVH_MIN_ITEMS = 8;
+constexpr size_t BVH_MAX_LEAF_ITEMS = 4;
+constexpr int BVH_SAH_BINS = 12;
+// Bounds the traversal stack in raytracer.glsl (BVH_STACK_SIZE)
+constexpr int BVH_MAX_DEPTH = 24;
+
+// GPU layout (std140: two vec4). Interior nodes have count == 0 and their
+// children at `first` and `first + 1`; leaves run instructions[first, first + count).
+struct alignas(16) bvh_node {
+  glm::vec3 min;
+  glm::uint first;
+  glm::vec3 max;
+  glm::uint count;
+};
+
+struct bvh_item {
+  aabb box;
+  glm::uint id; // caller's handle, e.g. a csg_tree node
+};
+
+// Binned SAH builder. `items` is reordered so that every leaf covers a
+// contiguous range of it; until the caller rewrites them, leaves store that
+// item range in first/count.
+class bvh_builder {
+public:
+  std::vector<bvh_node> nodes;
+
+  void build(std::vector<bvh_item> &items) {
+    nodes.clear();
+    if (items.empty()) return;
+    nodes.reserve(2 * items.size());
+    nodes.emplace_back();
+    build_node(items, 0, 0, items.size(), 0);
+  }
+
+private:
+  static aabb range_bounds(const std::vector<bvh_item> &items, size_t begin, size_t end) {
+    aabb box;
+    for (size_t i = begin; i < end; ++i) box = aabb::merge(box, items[i].box);
+    return box;
+  }
+
+  void make_leaf(glm::uint index, const aabb &box, size_t begin, size_t end) {
+    nodes[index] = {box.min, (glm::uint)begin, box.max, (glm::uint)(end - begin)};
+  }
+
+  void build_node(std::vector<bvh_item> &items, glm::uint index, size_t begin,
+                  size_t end, int depth) {
+    aabb box = range_bounds(items, begin, end);
+    size_t count = end - begin;
+    if (count == 1 || depth >= BVH_MAX_DEPTH) {
+      make_leaf(index, box, begin, end);
+      return;
+    }
+
+    aabb centroids;
+    for (size_t i = begin; i < end; ++i) centroids.expand(items[i].box.center());
+    glm::vec3 extent = centroids.max - centroids.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    size_t mid = begin + count / 2;
+    if (extent[axis] <= 0.0f) {
+      // Coincident centroids: no split helps, only keep leaves small
+      if (count <= BVH_MAX_LEAF_ITEMS) {
+        make_leaf(index, box, begin, end);
+        return;
+      }
+    } else {
+      struct bin { aabb box; size_t count = 0; };
+      bin bins[BVH_SAH_BINS];
+      float scale = BVH_SAH_BINS / extent[axis];
+      auto bin_of = [&](const bvh_item &item) {
+        int b = (int)((item.box.center()[axis] - centroids.min[axis]) * scale);
+        return std::min(b, BVH_SAH_BINS - 1);
+      };
+      for (size_t i = begin; i < end; ++i) {
+        bin &b = bins[bin_of(items[i])];
+        b.box = aabb::merge(b.box, items[i].box);
+        b.count++;
+      }
+
+      // Sweep from the right, then from the left, to cost every bin boundary
+      float right_cost[BVH_SAH_BINS];
+      aabb acc;
+      size_t acc_count = 0;
+      for (int i = BVH_SAH_BINS - 1; i > 0; --i) {
+        acc = aabb::merge(acc, bins[i].box);
+        acc_count += bins[i].count;
+        right_cost[i] = acc.surface_area() * acc_count;
+      }
+      float best_cost = std::numeric_limits<float>::infinity();
+      int best_split = -1;
+      acc = aabb();
+      acc_count = 0;
+      for (int i = 0; i < BVH_SAH_BINS - 1; ++i) {
+        acc = aabb::merge(acc, bins[i].box);
+        acc_count += bins[i].count;
+        if (acc_count == 0 || acc_count == count) continue;
+        float cost = acc.surface_area() * acc_count + right_cost[i + 1];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_split = i;
+        }
+      }
+
+      // Traversal costs 1, evaluating an item costs 1
+      float area = box.surface_area();
+      float split_cost = area > 0.0f ? 1.0f + best_cost / area : count;
+      if (count <= BVH_MAX_LEAF_ITEMS && (best_split < 0 || split_cost >= count)) {
+        make_leaf(index, box, begin, end);
+        return;
+      }
+      if (best_split >= 0) {
+        auto it = std::partition(items.begin() + begin, items.begin() + end,
+                                 [&](const bvh_item &item) { return bin_of(item) <= best_split; });
+        mid = it - items.begin();
+      }
+    }
+
+    if (mid == begin || mid == end) mid = begin + count / 2;
+    glm::uint left = nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[index] = {box.min, left, box.max, 0};
+    build_node(items, left, begin, mid, depth + 1);
+    build_node(items, left + 1, mid, end, depth + 1);
+  }
+};
+
+// Entry distance of the ray into a BVH node, or infinity on a miss. Matches
+// bvh_entry() in raytracer.glsl.
+inline float bvh_entry(const glm::vec3 &origin, const glm::vec3 &inv_dir, const bvh_node &node) {
+  glm::vec3 t0 = (node.min - origin) * inv_dir;
+  glm::vec3 t1 = (node.max - origin) * inv_dir;
+  glm::vec3 tmin = glm::min(t0, t1);
+  glm::vec3 tmax = glm::max(t0, t1);
+  float t_enter = std::max(std::max(tmin.x, tmin.y), tmin.z);
+  float t_exit = std::min(std::min(tmax.x, tmax.y), tmax.z);
+  if (t_enter > t_exit || t_exit < 0.0f) return std::numeric_limits<float>::infinity();
+  return t_enter;
+}
+
+#endif // BVH_H
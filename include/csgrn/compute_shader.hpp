@@ -4,6 +4,8 @@
 #include <fstream>
 #include <glad/glad.h>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 
@@ -11,8 +13,31 @@ class compute_shader {
 public:
   unsigned int id;
 
-  compute_shader(const char *path) {
+  compute_shader(const char *path) : compute_shader(load_source(path), "") {}
 
+  // Compiles `source` with `defines` inserted right after its #version line
+  // and `snippet` in place of its "// @inject" line.
+  compute_shader(const std::string &source, const std::string &defines,
+                 const std::string &snippet = "") {
+
+    std::string compute_code = inject_snippet(inject_defines(source, defines), snippet);
+
+    unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
+    const char *c_shader_code = compute_code.c_str();
+
+    glShaderSource(compute, 1, &c_shader_code, NULL);
+    glCompileShader(compute);
+    check_compile_errors(compute, "COMPUTE");
+
+    // shader Program
+    id = glCreateProgram();
+    glAttachShader(id, compute);
+    glLinkProgram(id);
+    check_compile_errors(id, "PROGRAM");
+    glDeleteShader(compute);
+  }
+
+  static std::string load_source(const char *path) {
     std::string compute_code;
     std::ifstream c_shader_file;
     c_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -24,22 +49,26 @@ public:
 
       c_shader_file.close();
       compute_code = c_shader_stream.str();
-    } catch (std::ifstream::failure e) {
+    } catch (std::ifstream::failure &e) {
       std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
     }
+    return compute_code;
+  }
 
-    unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
-    const char *c_shader_code = compute_code.c_str();
-
-    glShaderSource(compute, 1, &c_shader_code, NULL);
-    glCompileShader(compute);
-    check_compile_errors(compute, "COMPUTE");
+  static std::string inject_snippet(const std::string &source, const std::string &snippet) {
+    const std::string marker = "// @inject";
+    size_t pos = source.find(marker);
+    if (snippet.empty() || pos == std::string::npos) return source;
+    return source.substr(0, pos) + snippet + source.substr(pos + marker.size());
+  }
 
-    // shader Program
-    id = glCreateProgram();
-    glAttachShader(id, compute);
-    glLinkProgram(id);
-    check_compile_errors(id, "PROGRAM");
+  static std::string inject_defines(const std::string &source, const std::string &defines) {
+    if (defines.empty()) return source;
+    size_t version = source.find("#version");
+    if (version == std::string::npos) return defines + source;
+    size_t line_end = source.find('\n', version);
+    if (line_end == std::string::npos) return source + "\n" + defines;
+    return source.substr(0, line_end + 1) + defines + source.substr(line_end + 1);
   }
 
   void use() { glUseProgram(id); }
@@ -90,4 +119,37 @@ private:
   }
 };
 
+// Compiled variants of one compute shader, keyed by the defines and snippet
+// injected into it. Programs are built on first request and kept for the
+// cache's lifetime.
+class shader_variant_cache {
+public:
+  explicit shader_variant_cache(const char *path)
+      : source(compute_shader::load_source(path)) {}
+
+  shader_variant_cache(const shader_variant_cache &) = delete;
+  shader_variant_cache &operator=(const shader_variant_cache &) = delete;
+
+  ~shader_variant_cache() {
+    for (auto &[key, shader] : variants) {
+      glDeleteProgram(shader->id);
+    }
+  }
+
+  compute_shader &get(const std::string &defines, const std::string &snippet = "") {
+    std::string key = defines + '\0' + snippet;
+    auto it = variants.find(key);
+    if (it == variants.end()) {
+      it = variants.emplace(key, std::make_unique<compute_shader>(source, defines, snippet)).first;
+    }
+    return *it->second;
+  }
+
+  size_t size() const { return variants.size(); }
+
+private:
+  std::string source;
+  std::map<std::string, std::unique_ptr<compute_shader>> variants;
+};
+
 #endif // !COMPUTE_SHADER_H
@@ -0,0 +1,406 @@
+#ifndef CPU_RENDERER_H
+#define CPU_RENDERER_H
+
+#include "csgrn/csg_program.hpp"
+#include "csgrn/program_limits.hpp"
+#include "csgrn/span.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <glm/glm.hpp>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// C++ port of raytracer.glsl. It evaluates the same flattened program
+// (primitives, operations, instructions) and produces the same image, split in
+// tiles across all cores. Used where no GPU is available and as a baseline for
+// GPU work, so keep it in sync with the shader.
+class cpu_renderer {
+public:
+  static constexpr int TILE_SIZE = 32;
+
+  struct ray {
+    glm::vec3 origin;
+    glm::vec3 dir;
+  };
+
+  cpu_renderer(const csg_program_view &scene)
+      : scene(scene), limits(compute_program_limits(scene)) {
+    print_program_limits(limits);
+  }
+
+  // Renders a width x height RGBA float image, rows bottom to top like the GL
+  // texture. threads == 0 uses every core.
+  void render(const glm::vec3 &camera_pos, const glm::mat4 &view, int width,
+              int height, std::vector<float> &rgba, unsigned threads = 0) {
+    rgba.resize((size_t)width * height * 4);
+
+    // Per-frame object-space camera origins, as uploaded for the GPU
+    local_origins.resize(scene.primitives.size());
+    for (size_t i = 0; i < scene.primitives.size(); ++i) {
+      local_origins[i] = glm::vec3(scene.primitives[i].inv_transform * glm::vec4(camera_pos, 1.0f));
+    }
+    glm::mat4 inv_view = glm::inverse(view);
+
+    int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int tile_count = tiles_x * tiles_y;
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<unsigned>(threads, tile_count);
+
+    std::atomic<int> next_tile{0};
+    auto worker = [&]() {
+      workspace ws(limits);
+      for (int tile = next_tile++; tile < tile_count; tile = next_tile++) {
+        int x0 = (tile % tiles_x) * TILE_SIZE;
+        int y0 = (tile / tiles_x) * TILE_SIZE;
+        int x1 = std::min(x0 + TILE_SIZE, width);
+        int y1 = std::min(y0 + TILE_SIZE, height);
+        for (int y = y0; y < y1; ++y) {
+          for (int x = x0; x < x1; ++x) {
+            glm::vec3 color = shade_pixel(glm::ivec2(x, y), glm::ivec2(width, height),
+                                          camera_pos, inv_view, ws);
+            float *px = &rgba[((size_t)y * width + x) * 4];
+            px[0] = color.r;
+            px[1] = color.g;
+            px[2] = color.b;
+            px[3] = 1.0f;
+          }
+        }
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+  }
+
+private:
+  csg_program_view scene;
+  program_limits limits;
+  std::vector<glm::vec3> local_origins;
+
+  static constexpr float INF = std::numeric_limits<float>::infinity();
+
+  // Per-thread evaluation memory, laid out like the shader's pool: lists
+  // 0..stack_depth are the stack and a spare, the next one accumulates BVH
+  // leaves and the STORE/LOAD slots follow
+  struct workspace {
+    span_pool pool;
+    std::vector<int> list_at; // pool list of each stack position
+    int spare;                // free list receiving the next merge
+    int slot_base;
+
+    workspace(const program_limits &limits)
+        : pool(limits.stack_depth + 2 + limits.shared_slots, limits.max_spans),
+          list_at(limits.stack_depth), slot_base(limits.stack_depth + 2) {
+      reset();
+    }
+
+    void reset() {
+      for (size_t k = 0; k < list_at.size(); ++k) list_at[k] = (int)k;
+      spare = (int)list_at.size();
+    }
+  };
+
+  //If t_min > t_max, there is no intersection.
+  static glm::vec2 no_hit_span() { return glm::vec2(INF, -INF); }
+
+  // --- CSG & Intersection functions ---
+  static glm::vec2 intersect_unit_sphere(const ray &r) {
+    float a = glm::dot(r.dir, r.dir);
+    float b = 2.0f * glm::dot(r.origin, r.dir);
+    float c = glm::dot(r.origin, r.origin) - 1.0f;
+    float delta = b * b - 4.0f * a * c;
+
+    if (delta < 0.0f) {
+      return no_hit_span();
+    }
+    float sqrt_delta = std::sqrt(delta);
+    return glm::vec2(-b - sqrt_delta, -b + sqrt_delta) / (2.0f * a);
+  }
+
+  static glm::vec2 intersect_box_AABB(const ray &r) {
+    glm::vec3 box_min(-0.5f);
+    glm::vec3 box_max(0.5f);
+
+    glm::vec3 t0 = (box_min - r.origin) / r.dir;
+    glm::vec3 t1 = (box_max - r.origin) / r.dir;
+
+    glm::vec3 tmin = glm::min(t0, t1);
+    glm::vec3 tmax = glm::max(t0, t1);
+
+    float t_enter = std::max(std::max(tmin.x, tmin.y), tmin.z);
+    float t_exit = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+    if (t_exit < t_enter) {
+      return no_hit_span(); // NO HIT
+    }
+    return glm::vec2(t_enter, t_exit);
+  }
+
+  static glm::vec2 intersect_cylinder(const ray &r) {
+    glm::vec2 ro(r.origin.x, r.origin.z);
+    glm::vec2 rd(r.dir.x, r.dir.z);
+
+    float a = glm::dot(rd, rd);
+    float b = 2.0f * glm::dot(ro, rd);
+    float c = glm::dot(ro, ro) - 1.0f; // Radius is 1.0
+
+    float disc = b * b - 4.0f * a * c;
+
+    // If discriminant is negative, ray misses the infinite tube entirely
+    if (disc < 0.0f) return glm::vec2(1.0f, -1.0f);
+
+    float sqrt_disc = std::sqrt(disc);
+    float t_tube_enter = (-b - sqrt_disc) / (2.0f * a);
+    float t_tube_exit = (-b + sqrt_disc) / (2.0f * a);
+
+    float t_cap_bottom = (-0.5f - r.origin.y) / r.dir.y;
+    float t_cap_top = (0.5f - r.origin.y) / r.dir.y;
+
+    float t_cap_enter = std::min(t_cap_bottom, t_cap_top);
+    float t_cap_exit = std::max(t_cap_bottom, t_cap_top);
+
+    return glm::vec2(std::max(t_tube_enter, t_cap_enter), std::min(t_tube_exit, t_cap_exit));
+  }
+
+  static glm::vec3 get_local_normal(primitive_types type, glm::vec3 p) {
+    if (type == primitive_types::sphere) {
+      return glm::normalize(p);
+    } else if (type == primitive_types::cube) {
+      glm::vec3 abs_dist = glm::abs(p);
+      float max_axis = std::max(std::max(abs_dist.x, abs_dist.y), abs_dist.z);
+      return glm::normalize(glm::step(glm::vec3(max_axis - 0.0001f), abs_dist) * glm::sign(p));
+    } else if (type == primitive_types::cylinder) {
+      if (std::abs(p.y) > 0.499f) {
+        return glm::vec3(0.0f, p.y > 0.0f ? 1.0f : (p.y < 0.0f ? -1.0f : 0.0f), 0.0f);
+      }
+      return glm::normalize(glm::vec3(p.x, 0.0f, p.z));
+    }
+    return glm::vec3(0.0f, 1.0f, 0.0f); // Default fallback
+  }
+
+  // Span of primitive `id` along the ray, in its object space
+  glm::vec2 intersect_primitive(glm::uint id, const ray &r) const {
+    const primitive &p = scene.primitives[id];
+    ray transformed_ray;
+    transformed_ray.origin = local_origins[id];
+    transformed_ray.dir = glm::vec3(p.inv_transform * glm::vec4(r.dir, 0.0f));
+
+    if (p.type == primitive_types::sphere) return intersect_unit_sphere(transformed_ray);
+    if (p.type == primitive_types::cube) return intersect_box_AABB(transformed_ray);
+    if (p.type == primitive_types::cylinder) return intersect_cylinder(transformed_ray);
+    return no_hit_span();
+  }
+
+  // Sum-of-products evaluation: nearest hit over all products, see
+  // evaluate_scene() under SOP_LITERALS in raytracer.glsl
+  bool evaluate_sop(const ray &r, const glm::vec3 &inv_dir, packed_span &hit) const {
+    glm::vec2 spans[SOP_LITERALS_LIMIT];
+    float t_best = INF;
+    glm::uint best_id = 0;
+
+    for (const sop_product &product : scene.products) {
+      if (bvh_entry(r.origin, inv_dir, {product.min, 0, product.max, 0}) > t_best) continue;
+      const glm::uint *literals = &scene.literals[product.first];
+
+      float t_enter = -INF;
+      float t_exit = INF;
+      glm::uint enter_id = 0;
+      for (glm::uint k = 0; k < product.count; ++k) {
+        spans[k] = intersect_primitive(sop_literal_primitive(literals[k]), r);
+        if (!sop_literal_negated(literals[k])) {
+          if (spans[k].x > t_enter) {
+            t_enter = spans[k].x;
+            enter_id = sop_literal_primitive(literals[k]);
+          }
+          t_exit = std::min(t_exit, spans[k].y);
+        }
+      }
+      if (!(t_enter < t_exit)) continue; // a positive literal is missed
+
+      // Candidate c < count is the exit of negated literal c, count the entry
+      for (glm::uint c = 0; c <= product.count; ++c) {
+        float t = t_enter;
+        glm::uint id = enter_id;
+        if (c < product.count) {
+          if (!sop_literal_negated(literals[c]) || spans[c].x >= spans[c].y) continue;
+          t = spans[c].y;
+          id = sop_literal_primitive(literals[c]);
+        }
+        if (t <= 0.001f || t >= t_best || t < t_enter || t >= t_exit) continue;
+
+        bool removed = false;
+        for (glm::uint k = 0; k < product.count && !removed; ++k) {
+          removed = sop_literal_negated(literals[k]) && spans[k].x <= t && t < spans[k].y;
+        }
+        if (!removed) {
+          t_best = t;
+          best_id = pack_span_id(id, c < product.count);
+        }
+      }
+    }
+
+    if (t_best == INF) return false;
+    hit = {glm::vec2(t_best, INF), best_id};
+    return true;
+  }
+
+  // Evaluates instructions[first, end) for one ray. Returns the pool list
+  // holding the result, or -1 when the range leaves nothing on the stack.
+  int evaluate_range(const ray &r, const glm::vec3 &inv_dir, size_t first, size_t end,
+                     workspace &ws) const {
+    span_pool &pool = ws.pool;
+    const int depth = (int)limits.stack_depth;
+    int sp = 0;
+    for (size_t i = first; i < end; ++i) {
+      const instruction &inst = scene.instructions[i];
+      if (inst.type == (glm::uint)node_type::PRIMITIVE) {
+        if (sp >= depth) return -1; // the GPU would corrupt its stack here
+        pool.set_primitive(ws.list_at[sp++], intersect_primitive(inst.id, r), inst.id);
+      } else if (inst.type == (glm::uint)node_type::OPERATION) {
+        const operation &op = scene.operations[inst.id];
+        if (op.count < 2 || sp < (int)op.count) return -1;
+        sp -= op.count - 1;
+        int a = ws.list_at[sp - 1];
+        if (op.count > 2) {
+          pool.merge_many(ws.spare, &ws.list_at[sp - 1], op.count, op.type);
+        } else if (op.type == (glm::uint)op_types::op_reverse_difference) {
+          pool.merge(ws.spare, ws.list_at[sp], a, (glm::uint)op_types::op_difference);
+        } else {
+          pool.merge(ws.spare, a, ws.list_at[sp], op.type);
+        }
+        std::swap(ws.spare, ws.list_at[sp - 1]); // the result takes a's place
+      } else if (inst.type == (glm::uint)node_type::BOUNDS) {
+        // Ray misses the subtree's box: its result is empty, skip it
+        if (!ray_hits_bounds(r.origin, inv_dir, scene.node_bounds[inst.id])) {
+          if (sp >= depth) return -1;
+          pool.clear(ws.list_at[sp++]);
+          i += inst.skip;
+        }
+      } else if (inst.type == (glm::uint)node_type::SKIP_IF_EMPTY) {
+        // Empty minuend or intersection operand: the result stays empty
+        if (sp < 1 + (int)inst.id) return -1;
+        if (pool.count(ws.list_at[sp - 1]) == 0) {
+          sp -= inst.id;
+          pool.clear(ws.list_at[sp - 1]);
+          i += inst.skip;
+        }
+      } else if (inst.type == (glm::uint)node_type::SKIP_IF_BEYOND) {
+        // Union operand starting past the closest hit cannot change it
+        if (sp < 1) return -1;
+        if (ray_bounds_entry(r.origin, inv_dir, scene.node_bounds[inst.id]) >
+            pool.first_visible_entry(ws.list_at[sp - 1])) {
+          i += inst.skip;
+        }
+      } else if (inst.type == (glm::uint)node_type::STORE) {
+        if (sp < 1) return -1;
+        pool.copy(ws.slot_base + inst.id, ws.list_at[sp - 1]);
+      } else if (inst.type == (glm::uint)node_type::LOAD) {
+        if (sp >= depth) return -1;
+        pool.copy(ws.list_at[sp++], ws.slot_base + inst.id);
+      }
+    }
+    return sp == 0 ? -1 : ws.list_at[0];
+  }
+
+  // Front-to-back BVH traversal, see traverse_bvh() in raytracer.glsl.
+  // Returns the pool list holding the union of the visited leaves.
+  int traverse_bvh(const ray &r, const glm::vec3 &inv_dir, workspace &ws) const {
+    int acc = (int)limits.stack_depth + 1;
+    ws.pool.clear(acc);
+    float t_best = INF;
+
+    struct entry { glm::uint node; float t; };
+    entry pending[BVH_MAX_DEPTH + 2];
+    int sp = 0;
+
+    float t_root = bvh_entry(r.origin, inv_dir, scene.bvh_nodes[0]);
+    if (t_root != INF) pending[sp++] = {0, t_root};
+
+    while (sp > 0) {
+      entry e = pending[--sp];
+      if (e.t > t_best) continue;
+      const bvh_node &node = scene.bvh_nodes[e.node];
+
+      if (node.count > 0) {
+        int leaf = evaluate_range(r, inv_dir, node.first, node.first + node.count, ws);
+        if (leaf >= 0) {
+          ws.pool.merge(ws.spare, acc, leaf, (glm::uint)op_types::op_union);
+          std::swap(ws.spare, acc);
+          t_best = ws.pool.first_visible_entry(acc);
+        }
+        continue;
+      }
+
+      entry near{node.first, bvh_entry(r.origin, inv_dir, scene.bvh_nodes[node.first])};
+      entry far{node.first + 1, bvh_entry(r.origin, inv_dir, scene.bvh_nodes[node.first + 1])};
+      if (far.t < near.t) std::swap(near, far);
+      // Far child first so the near one is popped next
+      if (far.t != INF && far.t <= t_best && sp < BVH_MAX_DEPTH + 2) pending[sp++] = far;
+      if (near.t != INF && near.t <= t_best && sp < BVH_MAX_DEPTH + 2) pending[sp++] = near;
+    }
+    return acc;
+  }
+
+  // Evaluates the whole scene for one ray and returns its first visible span.
+  // Returns false when nothing is hit.
+  bool evaluate(const ray &r, workspace &ws, packed_span &hit) const {
+    glm::vec3 inv_dir = 1.0f / r.dir;
+    if (!scene.products.empty()) {
+      return evaluate_sop(r, inv_dir, hit);
+    }
+    ws.reset();
+    int list = scene.bvh_nodes.empty() ? evaluate_range(r, inv_dir, 0, scene.instructions.size(), ws)
+                                       : traverse_bvh(r, inv_dir, ws);
+    return list >= 0 && ws.pool.first_visible(list, hit);
+  }
+
+  glm::vec3 shade_pixel(glm::ivec2 pixel_coords, glm::ivec2 dims,
+                        const glm::vec3 &camera_pos, const glm::mat4 &inv_view,
+                        workspace &ws) const {
+    // --- Ray Generation ---
+    glm::vec2 uv = glm::vec2(pixel_coords) / glm::vec2(dims);
+    uv = uv * 2.0f - 1.0f;
+    uv.x *= float(dims.x) / float(dims.y);
+
+    ray r;
+    r.origin = camera_pos;
+
+    glm::vec3 color(0.5f, 0.7f, 1.0f); // Sky blue background
+    glm::vec3 light_dir = glm::normalize(glm::vec3(0.5f, 1.0f, 0.8f));
+    glm::vec4 world_space_target = inv_view * glm::vec4(uv.x, uv.y, -1.0f, 1.0f);
+    r.dir = glm::normalize(glm::vec3(world_space_target) / world_space_target.w - r.origin);
+
+    packed_span hit;
+    if (!evaluate(r, ws, hit)) return color;
+
+    float t_closest = hit.interval.x;
+    const primitive &prim = scene.primitives[span_primitive(hit.id)];
+
+    glm::vec3 world_pos = r.origin + r.dir * t_closest;
+    glm::vec3 local_pos = glm::vec3(prim.inv_transform * glm::vec4(world_pos, 1.0f));
+    glm::vec3 local_normal = get_local_normal(prim.type, local_pos);
+    glm::vec3 world_normal = glm::normalize(glm::mat3(prim.normal_matrix) * local_normal);
+
+    if (span_inverted(hit.id)) {
+      world_normal = -world_normal;
+    }
+
+    float ambient = 0.2f;
+    float diffuse = std::max(0.0f, glm::dot(world_normal, light_dir));
+
+    glm::vec3 view_dir = glm::normalize(camera_pos - world_pos);
+    glm::vec3 reflect_dir = glm::reflect(-light_dir, world_normal);
+    float spec = std::pow(std::max(glm::dot(view_dir, reflect_dir), 0.0f), 32.0f) * prim.mat.spec;
+    glm::vec3 albedo = glm::vec3(prim.mat.albedo);
+
+    return albedo * (ambient + diffuse) + glm::vec3(spec);
+  }
+};
+
+#endif // CPU_RENDERER_H
@@ -8,9 +8,11 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include <vector>
+#include <charconv>
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <vector>
 
 static const glm::mat4 z_to_y_up = glm::rotate(
       glm::mat4(1.0f), 
@@ -18,76 +20,141 @@ static const glm::mat4 z_to_y_up = glm::rotate(
       glm::vec3(1.0f, 0.0f, 0.0f)
 );
 
+// Streaming lexer over a read-only buffer (usually a mapped_file). Tokens are
+// string_views into the input, so lexing never allocates.
 class lexer {
-public:
-    static std::vector<std::string> tokenize(const std::string& input) {
-        std::vector<std::string> tokens;
-        std::string current;
-        for (char c : input) {
-            if (isspace(c)) continue;
-            if (c == '{' || c == '}' || c == '(' || c == ')' || 
-                c == '[' || c == ']' || c == ',' || c == ';' || c == '=') {
-                if (!current.empty()) {
-                    tokens.push_back(current);
-                    current.clear();
-                }
-                tokens.push_back(std::string(1, c));
-            } else {
-                current += c;
+    std::string_view input;
+    size_t cursor = 0;
+    std::string_view lookahead;
+    size_t lookahead_offset = 0;
+
+    static bool is_delimiter(char c) {
+        return c == '{' || c == '}' || c == '(' || c == ')' || 
+               c == '[' || c == ']' || c == ',' || c == ';' || c == '=';
+    }
+
+    static bool is_space(char c) {
+        return isspace(static_cast<unsigned char>(c));
+    }
+
+    void advance() {
+        while (cursor < input.size() && is_space(input[cursor])) cursor++;
+        lookahead_offset = cursor;
+        if (cursor >= input.size()) {
+            lookahead = std::string_view();
+            return;
+        }
+        size_t start = cursor;
+        if (is_delimiter(input[cursor])) {
+            cursor++;
+        } else {
+            while (cursor < input.size() && !is_space(input[cursor]) && !is_delimiter(input[cursor])) {
+                cursor++;
             }
         }
-        if (!current.empty()) tokens.push_back(current);
-        return tokens;
+        lookahead = input.substr(start, cursor - start);
     }
+
+public:
+    lexer(std::string_view input) : input(input) { advance(); }
+
+    // Empty view at end of input
+    std::string_view peek() const { return lookahead; }
+
+    std::string_view next() {
+        std::string_view t = lookahead;
+        advance();
+        return t;
+    }
+
+    bool at_end() const { return lookahead.empty(); }
+
+    // Byte offset of the current lookahead token, for diagnostics
+    size_t offset() const { return lookahead_offset; }
 };
 
+// The input buffer must outlive the parser: tokens are views into it.
 class csg_parser {
-    std::vector<std::string> tokens;
-    size_t pos = 0;
+    lexer lex;
+    csg_tree tree;
+    // Children of the operations currently being parsed, shared by all
+    // nesting levels so n-ary operations don't allocate per node
+    std::vector<node_id> pending_children;
+    // multmatrix() and color() wrappers around the node being parsed, composed
+    // on entry and applied once to each primitive when it is created
+    glm::mat4 current_transform = glm::mat4(1.0f);
+    glm::vec3 current_color = glm::vec3(1.0f);
+    bool colored = false;
+
+    // Returned by parse_exp() for an unsupported statement, which is not part
+    // of the scene at all (unlike an empty block, the empty set)
+    static constexpr node_id skipped_node = null_node - 1;
 
 public:
-    csg_parser(const std::string& input) {
-        tokens = lexer::tokenize(input);
+    csg_parser(std::string_view input) : lex(input) {
+        // Rough estimate: one node per ~64 bytes of OpenSCAD text
+        tree.reserve(input.size() / 64 + 1);
     }
 
-    csg_node* parse() {
-        if (tokens.empty()) {
+    // Builds the scene into a node arena. The returned tree is empty on failure.
+    csg_tree parse() {
+        if (lex.at_end()) {
              std::cerr << "[ERROR] No tokens to parse!" << std::endl;
-             return nullptr;
+             return csg_tree();
+        }
+        // Several top-level objects form an implicit union
+        tree.root = parse_union_block();
+        if (!lex.at_end()) {
+            std::cerr << "[SYNTAX ERROR] Unexpected '" << peek() << "' at pos " << lex.offset() << std::endl;
         }
-        return parse_exp();
+        return std::move(tree);
     }
 
 private:
-    std::string peek() {
-        if (pos < tokens.size()) return tokens[pos];
-        return ""; 
+    std::string_view peek() {
+        return lex.peek();
     }
 
-    std::string consume() {
-        if (pos >= tokens.size()) {
+    std::string_view consume() {
+        if (lex.at_end()) {
             std::cerr << "[ERROR] Attempted to consume past EOF!" << std::endl;
             return ""; 
         }
-        std::string t = tokens[pos++];
-        return t;
+        return lex.next();
     }
 
-    void expect(const std::string& token) {
-        std::string p = peek();
+    void expect(std::string_view token) {
+        std::string_view p = peek();
         if (p == token) {
             consume();
         } else {
-            std::cerr << "[SYNTAX ERROR] Expected '" << token << "' but got '" << p << "' at pos " << pos << std::endl;
+            std::cerr << "[SYNTAX ERROR] Expected '" << token << "' but got '" << p << "' at pos " << lex.offset() << std::endl;
         }
     }
 
-    csg_node* parse_exp() {
-        if (pos >= tokens.size()) return nullptr;
+    // Parses the next token as a float. Returns `fallback` and reports an error
+    // when the token is not a number.
+    float consume_float(float fallback = 0.0f) {
+        size_t offset = lex.offset();
+        std::string_view tok = consume();
+        float value = fallback;
+        const char* first = tok.data();
+        const char* last = tok.data() + tok.size();
+        if (!tok.empty() && *first == '+') first++;
+        auto [ptr, ec] = std::from_chars(first, last, value);
+        if (ec != std::errc() || ptr != last) {
+            std::cerr << "[ERROR] Expected a number but got '" << tok << "' at pos " << offset << std::endl;
+            return fallback;
+        }
+        return value;
+    }
 
-        std::string token = peek();
+    node_id parse_exp() {
+        if (lex.at_end()) return null_node;
 
-        if (token == "union" || token == "difference" || token == "intersection") {
+        std::string_view token = peek();
+
+        if (token == "union" || token == "difference" || token == "intersection" || token == "group") {
             consume(); // Eat the token
             return parse_op(token);
         } else if (token == "multmatrix") {
@@ -106,110 +173,168 @@ private:
            consume();
           return parse_cylinder();
         } else if (token == "}") {
-          return nullptr;
+          return null_node;
         }
-        
-        std::cerr << "[ERROR] Unknown token in parse_exp: " << token << std::endl;
-        consume(); // Skip unknown to avoid infinite loop
-        return nullptr;
+
+        std::cerr << "[ERROR] Unsupported statement '" << token << "' at pos " << lex.offset()
+                  << ", skipping it" << std::endl;
+        skip_statement();
+        return skipped_node;
     }
 
-    csg_node* parse_op(const std::string& typeStr) {
+    // Consumes a statement up to the ';' ending it or the '}' closing its
+    // block, with nested brackets balanced. Stops before a closing bracket
+    // of the enclosing block.
+    void skip_statement() {
+        int depth = 0;
+        while (!lex.at_end()) {
+            std::string_view tok = peek();
+            bool close = tok == ")" || tok == "]" || tok == "}";
+            if (close && depth == 0) return;
+            consume();
+            if (tok == "(" || tok == "[" || tok == "{") {
+                depth++;
+            } else if (close) {
+                if (--depth == 0 && tok == "}") return;
+            } else if (tok == ";" && depth == 0) {
+                return;
+            }
+        }
+    }
+
+    node_id parse_op(std::string_view typeStr) {
         
-        op_types type = op_types::op_none;
+        op_types type = op_types::op_union; // group() behaves like union()
         if (typeStr == "union") type = op_types::op_union;
         if (typeStr == "difference") type = op_types::op_difference;
         if (typeStr == "intersection") type = op_types::op_intersection;
 
         expect("("); expect(")"); expect("{");
 
-        csg_node* left = parse_exp();
-        
-        if (!left) {
-            std::cerr << "[ERROR] Left child of " << typeStr << " is NULL!" << std::endl;
-            return nullptr;
+        size_t first = pending_children.size();
+        parse_children();
+        expect("}");
+
+        size_t count = pending_children.size() - first;
+        if (count == 0) {
+            std::cerr << "[WARNING] " << typeStr << " has no children, skipping it." << std::endl;
+            return null_node;
         }
-        
-        if(peek() == ";") consume();
-        
-        csg_node* right = parse_exp();
 
-        if (!right) {
-             std::cerr << "[ERROR] Right child of " << typeStr << " is NULL!" << std::endl;
-             return nullptr;
+        node_id result;
+        if (type == op_types::op_difference && count > 1) {
+            // a - b - c - ... == a - (b + c + ...)
+            node_id minuend = pending_children[first];
+            node_id subtrahend = build_balanced(op_types::op_union, first + 1, first + count);
+            result = combine(op_types::op_difference, minuend, subtrahend);
+        } else {
+            result = build_balanced(type, first, first + count);
         }
-        
-        if(peek() == ";") consume();
 
-        expect("}");
+        pending_children.resize(first);
+        return result;
+    }
+
+    // Parses expressions up to the closing '}' (or EOF) and appends them to
+    // pending_children. Empty children stay as null_node, the empty set, and
+    // are folded by combine(); unsupported statements are left out.
+    void parse_children() {
+        while (!lex.at_end() && peek() != "}") {
+            if (peek() == ";") {
+                consume();
+                continue;
+            }
+            node_id child = parse_exp();
+            if (child != skipped_node) pending_children.push_back(child);
+        }
+    }
+
+    // Children up to the closing '}' as an implicit union, null_node if none
+    node_id parse_union_block() {
+        size_t first = pending_children.size();
+        parse_children();
+        node_id result = null_node;
+        if (pending_children.size() > first) {
+            result = build_balanced(op_types::op_union, first, pending_children.size());
+        }
+        pending_children.resize(first);
+        return result;
+    }
+
+    // Lowers the children in pending_children[begin, end) into a binary tree of
+    // depth ceil(log2(n)), so the RPN stack grows with log(n) instead of n.
+    node_id build_balanced(op_types type, size_t begin, size_t end) {
+        if (end - begin == 1) return pending_children[begin];
+        size_t mid = begin + (end - begin) / 2;
+        node_id left = build_balanced(type, begin, mid);
+        node_id right = build_balanced(type, mid, end);
+        return combine(type, left, right);
+    }
 
-        return new csg_node(type, left, right);    
+    // Operation on two nodes, folding the empty set:
+    // A + 0 = A, A * 0 = 0, A - 0 = A, 0 - A = 0
+    node_id combine(op_types type, node_id left, node_id right) {
+        if (type == op_types::op_union) {
+            if (left == null_node) return right;
+            if (right == null_node) return left;
+        } else if (left == null_node || right == null_node) {
+            return type == op_types::op_difference && right == null_node ? left : null_node;
+        }
+        return tree.add_operation(type, left, right);
     }
 
-    csg_node* parse_multimatrix() {
+    node_id parse_multimatrix() {
         expect("(");
         glm::mat4 mat = parse_matrix_data();
         
         expect(")"); 
         expect("{");
 
-        csg_node* child = parse_exp();
-        
-        if (!child) {
-            std::cerr << "[CRITICAL ERROR] multmatrix child is NULL. Cannot apply transform." << std::endl;
-            return nullptr;
-        }
-
-        if(peek() == ";") consume();
+        glm::mat4 outer = current_transform;
+        current_transform = outer * mat;
+        node_id child = parse_union_block();
+        current_transform = outer;
         expect("}");
-
-        //mat = glm::rotate(mat, glm::half_pi<float>(), glm::vec3(1,0,0));
-        child->transform = mat * child->transform;
-        
         return child;
     }
 
-    csg_node* parse_color() {
+    node_id parse_color() {
         expect("(");
         expect("[");
-        float r = std::stof(consume()); expect(",");
-        float g = std::stof(consume()); expect(",");
-        float b = std::stof(consume()); 
+        float r = consume_float(1.0f); expect(",");
+        float g = consume_float(1.0f); expect(",");
+        float b = consume_float(1.0f); 
         if (peek() == ",") { consume(); consume(); } 
         expect("]");
         expect(")"); 
         expect("{");
 
-        csg_node* child = parse_exp();
-        
-        if (!child) {
-            std::cerr << "[CRITICAL ERROR] color child is NULL. Cannot apply color." << std::endl;
-            return nullptr;
+        // The outermost color wins. OpenSCAD exports [-1, -1, -1] for "no
+        // color": keep whatever is below.
+        glm::vec3 outer = current_color;
+        bool outer_colored = colored;
+        if (!colored && r >= 0.0f && g >= 0.0f && b >= 0.0f) {
+            current_color = glm::vec3(r, g, b);
+            colored = true;
         }
-
-        if(peek() == ";") consume();
+        node_id child = parse_union_block();
+        current_color = outer;
+        colored = outer_colored;
         expect("}");
-
-        child->color = glm::vec3(r, g, b);
         return child;
     }
 
-    csg_node* parse_sphere() {
-        csg_node* node = new csg_node(primitive_types::sphere);
+    node_id parse_sphere() {
         float radius = 1.0f; // Default radius
 
         expect("(");
         
         while(peek() != ")" && peek() != "") {
-            std::string param = consume();
+            std::string_view param = consume();
             if (param == "r") {
                 if (peek() == "=") {
                     consume(); 
-                    try {
-                        radius = std::stof(consume());
-                    } catch (...) {
-                        std::cerr << "[ERROR] Could not parse sphere radius value." << std::endl;
-                    }
+                    radius = consume_float(1.0f);
                 }
             } else {
                 if (peek() == "=") {
@@ -226,41 +351,36 @@ private:
         expect(")");
         if(peek() == ";") consume();
 
-        node->transform = glm::scale(node->transform, glm::vec3(radius));
-
-        return node;
+        return add_primitive(primitive_types::sphere, glm::scale(glm::mat4(1.0f), glm::vec3(radius)));
     }
 
-csg_node* parse_cube() {
-        std::cout << "[DEBUG] Parsing Cube" << std::endl;
-        csg_node* node = new csg_node(primitive_types::cube); 
-        
+node_id parse_cube() {
         glm::vec3 size(1.0f);
         bool center = true;  
 
         expect("(");
         
         while(peek() != ")" && peek() != "") {
-            std::string param = consume();
+            std::string_view param = consume();
             
             if (param == "size") {
                 if (peek() == "=") consume(); 
 
                 if (peek() == "[") {
                     consume();
-                    float x = std::stof(consume()); expect(",");
-                    float y = std::stof(consume()); expect(",");
-                    float z = std::stof(consume()); 
+                    float x = consume_float(1.0f); expect(",");
+                    float y = consume_float(1.0f); expect(",");
+                    float z = consume_float(1.0f); 
                     expect("]");
                     size = glm::vec3(x, y, z);
                 } else {
-                    float s = std::stof(consume());
+                    float s = consume_float(1.0f);
                     size = glm::vec3(s);
                 }
             } 
             else if (param == "center") {
                 if (peek() == "=") consume(); 
-                std::string val = consume();
+                std::string_view val = consume();
                 if (val == "false") center = false;
             }
 
@@ -270,20 +390,18 @@ csg_node* parse_cube() {
         expect(")");
         if(peek() == ";") consume();
 
-        node->transform = glm::scale(node->transform, size);
+        glm::mat4 transform = glm::scale(glm::mat4(1.0f), size);
 
         if (!center) {
-             node->transform = glm::translate(node->transform, glm::vec3(0.5f));
+             transform = glm::translate(transform, glm::vec3(0.5f));
         }
 
-        node->transform = z_to_y_up * node->transform;
+        transform = z_to_y_up * transform;
 
-        return node;
+        return add_primitive(primitive_types::cube, transform);
     }
 
-csg_node* parse_cylinder() {
-        csg_node* node = new csg_node(primitive_types::cylinder); 
-        
+node_id parse_cylinder() {
         float h = 1.0f;       // Default height
         float r1 = 1.0f;
         float r2 = 1.0f;
@@ -292,23 +410,23 @@ csg_node* parse_cylinder() {
         expect("(");
         
         while(peek() != ")" && peek() != "") {
-            std::string param = consume();
+            std::string_view param = consume();
             
             if (param == "h" || param == "height") {
                 if (peek() == "=") consume(); 
-                h = std::stof(consume());
+                h = consume_float(1.0f);
             } 
             else if (param == "r1" || param == "radius") {
                 if (peek() == "=") consume(); 
-                r1 = std::stof(consume());
+                r1 = consume_float(1.0f);
             }
             if (param == "r2") {
                 if (peek() == "=") consume(); 
-                r2 = std::stof(consume());
+                r2 = consume_float(1.0f);
             }
             else if (param == "center") {
                 if (peek() == "=") consume(); 
-                std::string val = consume();
+                std::string_view val = consume();
                 if (val == "false") center = false;
             }
 
@@ -318,12 +436,19 @@ csg_node* parse_cylinder() {
         expect(")");
         if(peek() == ";") consume();
 
-        node->transform = glm::scale(node->transform, glm::vec3(r1, h, r1));
+        glm::mat4 transform = glm::scale(glm::mat4(1.0f), glm::vec3(r1, h, r1));
         if (!center) {
-             node->transform = glm::translate(node->transform, glm::vec3(0.0f, 0.5f, 0.0f));
+             transform = glm::translate(transform, glm::vec3(0.0f, 0.5f, 0.0f));
         }
 
-        return node;
+        return add_primitive(primitive_types::cylinder, transform);
+    }
+
+    // Primitive placed by `local` inside the enclosing multmatrix() and color()
+    node_id add_primitive(primitive_types type, const glm::mat4& local) {
+        node_id leaf = tree.add_primitive(type, current_transform * local);
+        tree.colors[tree[leaf].attr] = current_color;
+        return leaf;
     }
 
     glm::mat4 parse_matrix_data() {
@@ -336,13 +461,7 @@ csg_node* parse_cylinder() {
         for(int row = 0; row < 4; ++row) {
             expect("[");
             for(int col = 0; col < 4; ++col) {
-                std::string valStr = consume();
-                try {
-                    temp[idx++] = std::stof(valStr);
-                } catch (...) {
-                    std::cerr << "[ERROR] Matrix parse failed on value: " << valStr << std::endl;
-                    temp[idx-1] = 0.0f;
-                }
+                temp[idx++] = consume_float(0.0f);
                 if(col < 3) expect(",");
             }
             expect("]");
@@ -0,0 +1,115 @@
+#ifndef CSG_PROFILE_H
+#define CSG_PROFILE_H
+
+#include "csgrn/csg_program.hpp"
+#include "csgrn/csg_tree.hpp"
+#include <iostream>
+#include <span>
+#include <vector>
+
+// Profile-guided operand order. The shader's profiled variant counts, per
+// instruction, how often it ran and its outcome (see raytracer.glsl). Mapped
+// back through csg_tree::node_ranges, that gives for every node how often
+// rays reached it, how often its result was non-empty and how many
+// primitives and operations it evaluated on average.
+//
+// With those rates, reorder() picks the operand order that minimizes the
+// expected work of each gated operation. An intersection only needs its
+// second operand when the first is non-empty; a union on the root spine is
+// counted as only needing it when the first is empty (the best case of
+// SKIP_IF_BEYOND). Differences are not commutative and keep their order.
+
+// Expected cost must drop by this fraction before an order is changed
+constexpr double PROFILE_MIN_GAIN = 0.05;
+
+class csg_profile {
+public:
+  struct node_stats {
+    double reached = 0.0;  // times a ray started evaluating the node
+    double nonempty = 0.0; // times its result was non-empty
+    double work = 0.0;     // primitives and operations evaluated inside it
+  };
+  std::vector<node_stats> nodes;
+
+  // Adds the counters of a profiled render of `program`, which must be the
+  // last flatten_tree() output of `tree`.
+  void accumulate(const csg_tree &tree, const csg_program_view &program,
+                  std::span<const glm::uint> counters) {
+    nodes.resize(tree.nodes.size());
+    if (counters.size() < 2 * program.instructions.size()) {
+      std::cerr << "[ERROR] Profile counters do not match the program" << std::endl;
+      return;
+    }
+    auto executed = [&](glm::uint i) { return (double)counters[2 * i]; };
+    auto outcome = [&](glm::uint i) { return (double)counters[2 * i + 1]; };
+
+    for (const csg_tree::node_range &range : tree.node_ranges) {
+      node_stats &stats = nodes[range.node];
+      stats.reached += executed(range.begin);
+      stats.nonempty += outcome(range.end - 1);
+      // A taken SKIP_IF_BEYOND leaves the non-empty first operand as result
+      if (range.gate != null_node &&
+          program.instructions[range.gate].type == (glm::uint)node_type::SKIP_IF_BEYOND) {
+        stats.nonempty += outcome(range.gate);
+      }
+      for (glm::uint i = range.begin; i < range.end; ++i) {
+        glm::uint type = program.instructions[i].type;
+        if (type == (glm::uint)node_type::PRIMITIVE || type == (glm::uint)node_type::OPERATION) {
+          stats.work += executed(i);
+        }
+      }
+    }
+  }
+
+  // Sets tree.first_operand for every intersection and spine union whose
+  // other order is expected to be cheaper. Returns the number of nodes set.
+  size_t reorder(csg_tree &tree) const {
+    tree.first_operand.assign(tree.nodes.size(), null_node);
+    if (tree.empty() || nodes.size() != tree.nodes.size()) return 0;
+
+    std::vector<bool> spine(tree.nodes.size(), false);
+    std::vector<node_id> pending{tree.root};
+    while (!pending.empty()) {
+      node_id id = pending.back();
+      pending.pop_back();
+      const csg_node &node = tree[id];
+      if (node.is_leave() || node.op != op_types::op_union || spine[id]) continue;
+      spine[id] = true;
+      pending.push_back(node.left);
+      pending.push_back(node.right);
+    }
+
+    size_t changed = 0;
+    for (node_id id = 0; id < tree.nodes.size(); ++id) {
+      const csg_node &node = tree[id];
+      if (node.is_leave()) continue;
+      bool is_union = node.op == op_types::op_union;
+      if (node.op != op_types::op_intersection && !(is_union && spine[id])) continue;
+
+      const node_stats &l = nodes[node.left];
+      const node_stats &r = nodes[node.right];
+      if (l.reached <= 0.0 || r.reached <= 0.0) continue; // no data for one side
+
+      // Average work and probability that the second operand is needed
+      double work_l = l.work / l.reached, work_r = r.work / r.reached;
+      double need_after_l = l.nonempty / l.reached, need_after_r = r.nonempty / r.reached;
+      if (is_union) {
+        need_after_l = 1.0 - need_after_l;
+        need_after_r = 1.0 - need_after_r;
+      }
+      double left_first = work_l + need_after_l * work_r;
+      double right_first = work_r + need_after_r * work_l;
+
+      if (right_first < left_first * (1.0 - PROFILE_MIN_GAIN)) {
+        tree.first_operand[id] = node.right;
+        changed++;
+      } else if (left_first < right_first * (1.0 - PROFILE_MIN_GAIN)) {
+        tree.first_operand[id] = node.left;
+        changed++;
+      }
+    }
+    return changed;
+  }
+};
+
+#endif // CSG_PROFILE_H
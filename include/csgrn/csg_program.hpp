@@ -0,0 +1,54 @@
+#ifndef CSG_PROGRAM_H
+#define CSG_PROGRAM_H
+
+#include "csgrn/bounds.hpp"
+#include "csgrn/bvh.hpp"
+#include "csgrn/op_instruction.hpp"
+#include "csgrn/operations.hpp"
+#include "csgrn/primitive.hpp"
+#include "csgrn/sop_product.hpp"
+#include <span>
+#include <vector>
+
+// The flattened scene: exactly what gets uploaded to the SSBOs. A scene
+// compiled to sum-of-products form has products and literals instead of
+// operations and instructions.
+struct csg_program {
+  std::vector<primitive> primitives;
+  std::vector<operation> operations;
+  std::vector<instruction> instructions;
+  std::vector<bounds> node_bounds; // world-space boxes used by BOUNDS instructions
+  std::vector<bvh_node> bvh_nodes; // top-level BVH over instruction ranges, may be empty
+  std::vector<sop_product> products;
+  std::vector<glm::uint> literals;
+
+  void clear() {
+    primitives.clear();
+    operations.clear();
+    instructions.clear();
+    node_bounds.clear();
+    bvh_nodes.clear();
+    products.clear();
+    literals.clear();
+  }
+};
+
+// Non-owning view over a flattened scene, either a csg_program in memory or
+// the sections of a mapped .csgb file.
+struct csg_program_view {
+  std::span<const primitive> primitives;
+  std::span<const operation> operations;
+  std::span<const instruction> instructions;
+  std::span<const bounds> node_bounds;
+  std::span<const bvh_node> bvh_nodes;
+  std::span<const sop_product> products;
+  std::span<const glm::uint> literals;
+
+  csg_program_view() = default;
+  csg_program_view(const csg_program &program)
+      : primitives(program.primitives), operations(program.operations),
+        instructions(program.instructions), node_bounds(program.node_bounds),
+        bvh_nodes(program.bvh_nodes), products(program.products), literals(program.literals) {}
+};
+
+#endif // CSG_PROGRAM_H
@@ -0,0 +1,274 @@
+#ifndef CSG_SIMPLIFY_H
+#define CSG_SIMPLIFY_H
+
+#include "csgrn/csg_tree.hpp"
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Compile pass between csg_parser::parse() and csg_tree::flatten_tree().
+// Rebuilds the tree as a hash-consed DAG, so structurally identical subtrees
+// (same primitive, transform and color, or same operation on the same
+// operands) become one node, and folds Boolean identities on the way:
+//
+//   A + A = A      A * A = A      A - A = 0      A - 0 = A      0 - A = 0
+//   A * (A + B) = A      A + (A * B) = A      A + 0 = A      A * 0 = 0
+//
+// Unions and intersections are handled as n-ary clusters, so duplicates are
+// found anywhere in an OpenSCAD children list, not only between siblings of
+// the balanced lowering. The empty set is null_node; an empty scene ends up
+// with no root. Shared nodes are evaluated once per ray by flatten_tree().
+//
+// Conservative bounds remove geometry that can never show: an intersection
+// whose operands' boxes are disjoint is empty, and subtrahends that miss the
+// minuend's box are dropped from a difference.
+class csg_simplifier {
+public:
+  struct stats {
+    size_t primitives_in = 0;  // primitives in the parsed tree
+    size_t primitives_out = 0; // distinct primitives left
+    size_t pruned = 0;         // primitive instances removed by bounds
+    size_t folded = 0;         // removed by the identities 0 - A, A * 0 and A - A
+  };
+  stats last;
+
+  csg_tree simplify(const csg_tree &in) {
+    src = &in;
+    out = csg_tree();
+    out.reserve(in.nodes.size());
+    leaves.clear();
+    ops.clear();
+    boxes.clear();
+    leaf_counts.clear();
+    last = stats();
+    out.root = rebuild(in.root);
+    last.primitives_out = count_distinct_leaves(out.root);
+    return std::move(out);
+  }
+
+private:
+  struct leaf_key {
+    primitive_types type;
+    glm::mat4 transform;
+    glm::vec3 color;
+
+    bool operator==(const leaf_key &o) const {
+      return type == o.type && transform == o.transform && color == o.color;
+    }
+  };
+
+  struct leaf_key_hash {
+    static void mix(size_t &h, float f) {
+      f += 0.0f; // -0 and +0 compare equal, so they must hash equal
+      uint32_t bits;
+      std::memcpy(&bits, &f, sizeof(bits));
+      h ^= bits + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+    size_t operator()(const leaf_key &k) const {
+      size_t h = (size_t)k.type;
+      for (int c = 0; c < 4; ++c)
+        for (int r = 0; r < 4; ++r) mix(h, k.transform[c][r]);
+      for (int i = 0; i < 3; ++i) mix(h, k.color[i]);
+      return h;
+    }
+  };
+
+  struct op_key {
+    op_types op;
+    node_id left, right;
+    bool operator==(const op_key &o) const {
+      return op == o.op && left == o.left && right == o.right;
+    }
+  };
+
+  struct op_key_hash {
+    size_t operator()(const op_key &k) const {
+      uint64_t h = ((uint64_t)k.left << 32 | k.right) * 0x9e3779b97f4a7c15ull;
+      return (size_t)(h ^ (uint64_t)k.op);
+    }
+  };
+
+  const csg_tree *src = nullptr;
+  csg_tree out;
+  std::unordered_map<leaf_key, node_id, leaf_key_hash> leaves;
+  std::unordered_map<op_key, node_id, op_key_hash> ops;
+  // Per node of `out`: world-space bounds and number of primitive instances
+  std::vector<aabb> boxes;
+  std::vector<size_t> leaf_counts;
+
+  size_t instances(node_id id) const { return id == null_node ? 0 : leaf_counts[id]; }
+
+  // Records `id` as removed by bounds and returns the empty set
+  node_id prune(node_id id) {
+    last.pruned += instances(id);
+    return null_node;
+  }
+
+  // Records `id` as removed by an empty-set identity and returns the empty set
+  node_id fold(node_id id) {
+    last.folded += instances(id);
+    return null_node;
+  }
+
+  size_t count_distinct_leaves(node_id root) const {
+    if (root == null_node) return 0;
+    std::unordered_set<node_id> visited;
+    std::vector<node_id> pending{root};
+    size_t count = 0;
+    while (!pending.empty()) {
+      node_id id = pending.back();
+      pending.pop_back();
+      if (!visited.insert(id).second) continue;
+      const csg_node &node = out[id];
+      if (node.is_leave()) {
+        count++;
+      } else {
+        pending.push_back(node.left);
+        pending.push_back(node.right);
+      }
+    }
+    return count;
+  }
+
+  node_id rebuild(node_id id) {
+    if (id == null_node) return null_node;
+    const csg_node &node = src->nodes[id];
+    if (node.is_leave()) {
+      last.primitives_in++;
+      leaf_key key{node.primitive, src->transforms[node.attr], src->colors[node.attr]};
+      auto it = leaves.find(key);
+      if (it != leaves.end()) return it->second;
+      node_id leaf = out.add_primitive(key.type, key.transform);
+      out.colors[out[leaf].attr] = key.color;
+      boxes.push_back(primitive_bounds(key.type, key.transform));
+      leaf_counts.push_back(1);
+      leaves.emplace(key, leaf);
+      return leaf;
+    }
+
+    if (node.op == op_types::op_union || node.op == op_types::op_intersection) {
+      std::vector<node_id> parts;
+      src->collect_cluster(id, node.op, parts);
+      for (node_id &part : parts) part = rebuild(part);
+      return make_cluster(node.op, parts);
+    }
+
+    node_id a = rebuild(node.left);
+    node_id b = rebuild(node.right);
+    if (node.op == op_types::op_difference) {
+      if (a == null_node) return fold(b);
+      if (a == b) {
+        fold(a); // A - A = 0
+        return fold(b);
+      }
+      b = clip_subtrahend(boxes[a], b);
+      if (b == null_node) return a;
+    }
+    return make_op(node.op, a, b);
+  }
+
+  // Keeps only the members of the subtrahend union that touch `minuend`
+  node_id clip_subtrahend(const aabb &minuend, node_id b) {
+    if (b == null_node) return b;
+    std::vector<node_id> tools;
+    out.collect_cluster(b, op_types::op_union, tools);
+    size_t count = 0;
+    for (node_id tool : tools) {
+      if (aabb::overlaps(minuend, boxes[tool])) {
+        tools[count++] = tool;
+      } else {
+        last.pruned += instances(tool);
+      }
+    }
+    if (count == tools.size()) return b;
+    tools.resize(count);
+    return make_cluster(op_types::op_union, tools);
+  }
+
+  // n-ary union or intersection of already rebuilt nodes
+  node_id make_cluster(op_types op, std::vector<node_id> &parts) {
+    bool is_union = op == op_types::op_union;
+    std::vector<node_id> kept;
+    std::unordered_set<node_id> seen;
+    for (node_id part : parts) {
+      if (part == null_node) {
+        if (is_union) continue;
+        for (node_id p : parts) fold(p); // anything * 0 = 0
+        return null_node;
+      }
+      if (seen.insert(part).second) kept.push_back(part);
+    }
+
+    // Absorption: drop an intersection containing another union member, or
+    // a union containing another intersection member
+    op_types inner = is_union ? op_types::op_intersection : op_types::op_union;
+    std::vector<node_id> members;
+    size_t count = 0;
+    for (node_id part : kept) {
+      const csg_node &node = out[part];
+      bool absorbed = false;
+      if (!node.is_leave() && node.op == inner) {
+        members.clear();
+        out.collect_cluster(part, inner, members);
+        for (node_id m : members) {
+          if (m != part && seen.count(m)) {
+            absorbed = true;
+            break;
+          }
+        }
+      }
+      if (absorbed) {
+        seen.erase(part);
+      } else {
+        kept[count++] = part;
+      }
+    }
+    kept.resize(count);
+
+    if (kept.empty()) return null_node;
+    if (!is_union) {
+      // Disjoint boxes: the intersection is empty
+      aabb box = boxes[kept[0]];
+      for (node_id part : kept) box = aabb::intersect(box, boxes[part]);
+      if (box.empty()) {
+        for (node_id part : kept) prune(part);
+        return null_node;
+      }
+    }
+    return build_balanced(op, kept, 0, kept.size());
+  }
+
+  node_id build_balanced(op_types op, const std::vector<node_id> &parts, size_t begin, size_t end) {
+    if (end - begin == 1) return parts[begin];
+    size_t mid = begin + (end - begin) / 2;
+    return make_op(op, build_balanced(op, parts, begin, mid), build_balanced(op, parts, mid, end));
+  }
+
+  node_id make_op(op_types op, node_id a, node_id b) {
+    op_key key{op, a, b};
+    if (op != op_types::op_difference && key.left > key.right) std::swap(key.left, key.right);
+    auto it = ops.find(key);
+    if (it != ops.end()) return it->second;
+    node_id id = out.add_operation(op, a, b);
+    boxes.push_back(operation_bounds(op, boxes[a], boxes[b]));
+    leaf_counts.push_back(leaf_counts[a] + leaf_counts[b]);
+    ops.emplace(key, id);
+    return id;
+  }
+};
+
+inline csg_tree simplify_tree(const csg_tree &tree) {
+  csg_simplifier simplifier;
+  return simplifier.simplify(tree);
+}
+
+inline void print_simplify_stats(const csg_simplifier::stats &stats) {
+  std::cout << "[SIMPLIFY] " << stats.primitives_in << " primitives -> "
+            << stats.primitives_out << " distinct, " << stats.pruned
+            << " removed by bounds, " << stats.folded << " by empty-set identities\n";
+}
+
+#endif // CSG_SIMPLIFY_H
@@ -0,0 +1,188 @@
+#ifndef CSG_SOP_H
+#define CSG_SOP_H
+
+#include "csgrn/csg_program.hpp"
+#include "csgrn/csg_tree.hpp"
+#include "csgrn/sop_product.hpp"
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+// Optional compile mode: rewrites the tree in Goldfeather normal form, a union
+// of products of possibly negated primitives,
+//
+//   A - B = A * !B      !(A + B) = !A * !B      !(A * B) = !A + !B
+//
+// and intersections distributed over unions. The shader then evaluates each
+// product with a fixed-size classification and keeps the nearest hit instead
+// of merging interval lists, so it needs no span pool.
+//
+// The form can grow exponentially (a subtrahend with n products multiplies
+// the minuend's products by up to n literals each), so it suits wide but
+// shallow trees. Trees that exceed the limits below keep the normal program.
+constexpr size_t SOP_MAX_PRODUCTS = 256;
+
+class sop_normalizer {
+public:
+  const char *failure = ""; // why the last flatten() returned false
+
+  // Compiles `tree` into products and literals. Returns false, leaving
+  // `program` untouched, when the form exceeds the limits.
+  bool flatten(csg_tree &tree, csg_program &program) {
+    src = &tree;
+    memo.clear();
+    failure = "";
+    if (tree.empty()) return fail("empty scene");
+
+    sum products = normalize(tree.root);
+    if (*failure) return false;
+
+    // A product only exists where all its positive literals overlap, and
+    // negated literals outside that box never remove anything
+    std::vector<aabb> boxes;
+    size_t count = 0;
+    for (size_t i = 0; i < products.size(); ++i) {
+      product &p = products[i];
+      aabb box;
+      bool bounded = false;
+      for (glm::uint literal : p) {
+        if (sop_literal_negated(literal)) continue;
+        aabb b = tree.subtree_bounds(sop_literal_primitive(literal));
+        box = bounded ? aabb::intersect(box, b) : b;
+        bounded = true;
+      }
+      if (!bounded) return fail("a product has no positive primitive");
+      if (box.empty()) continue;
+      p.erase(std::remove_if(p.begin(), p.end(),
+                             [&](glm::uint literal) {
+                               return sop_literal_negated(literal) &&
+                                      !aabb::overlaps(box, tree.subtree_bounds(sop_literal_primitive(literal)));
+                             }),
+              p.end());
+      if (count != i) products[count] = std::move(p);
+      count++;
+      boxes.push_back(box);
+    }
+    products.resize(count);
+
+    program.clear();
+    std::unordered_map<node_id, glm::uint> index; // leaf -> primitives[] entry
+    for (size_t i = 0; i < products.size(); ++i) {
+      sop_product out{boxes[i].min, (glm::uint)program.literals.size(), boxes[i].max,
+                      (glm::uint)products[i].size()};
+      for (glm::uint literal : products[i]) {
+        node_id leaf = sop_literal_primitive(literal);
+        auto it = index.find(leaf);
+        if (it == index.end()) {
+          it = index.emplace(leaf, (glm::uint)program.primitives.size()).first;
+          program.primitives.push_back(tree.to_primitive(leaf));
+        }
+        program.literals.push_back(sop_literal(it->second, sop_literal_negated(literal)));
+      }
+      program.products.push_back(out);
+    }
+    return true;
+  }
+
+private:
+  // Sorted literals over csg_tree leaves: node id << 1 | negated
+  using product = std::vector<glm::uint>;
+  using sum = std::vector<product>;
+
+  csg_tree *src = nullptr;
+  std::unordered_map<node_id, sum> memo; // shared subtrees are normalized once
+
+  bool fail(const char *reason) {
+    if (!*failure) failure = reason;
+    return false;
+  }
+
+  const sum &normalize(node_id id) {
+    auto it = memo.find(id);
+    if (it != memo.end()) return it->second;
+
+    sum result; // no products: the empty set
+    if (id == null_node) return memo.emplace(id, std::move(result)).first->second;
+
+    const csg_node &node = (*src)[id];
+    if (node.is_leave()) {
+      result.push_back({sop_literal(id, false)});
+    } else {
+      const sum &a = normalize(node.left);
+      const sum &b = normalize(node.right);
+      if (!*failure) {
+        if (node.op == op_types::op_union) {
+          result = a;
+          result.insert(result.end(), b.begin(), b.end());
+          reduce(result);
+        } else if (node.op == op_types::op_intersection) {
+          result = multiply(a, b);
+        } else {
+          result = multiply(a, negate(b));
+        }
+      }
+    }
+    return memo.emplace(id, std::move(result)).first->second;
+  }
+
+  // De Morgan: the complement of a union of products is the product of the
+  // complemented products, each a union of negated literals
+  sum negate(const sum &s) {
+    sum result{product()}; // everything
+    for (const product &p : s) {
+      sum factor;
+      for (glm::uint literal : p) factor.push_back({literal ^ 1u});
+      result = multiply(result, factor);
+      if (*failure) break;
+    }
+    return result;
+  }
+
+  sum multiply(const sum &a, const sum &b) {
+    sum result;
+    if (a.size() * b.size() > SOP_MAX_PRODUCTS * 4) {
+      fail("too many products");
+      return result;
+    }
+    product merged;
+    for (const product &pa : a) {
+      for (const product &pb : b) {
+        merged.clear();
+        std::set_union(pa.begin(), pa.end(), pb.begin(), pb.end(), std::back_inserter(merged));
+        // A and !A sort next to each other: such a product is empty
+        bool contradiction = false;
+        for (size_t i = 1; i < merged.size() && !contradiction; ++i) {
+          contradiction = (merged[i] ^ merged[i - 1]) == 1u;
+        }
+        if (!contradiction) result.push_back(merged);
+      }
+    }
+    reduce(result);
+    return result;
+  }
+
+  // Drops duplicates and absorbed products (those containing another one),
+  // then checks the limits
+  void reduce(sum &s) {
+    std::sort(s.begin(), s.end(), [](const product &x, const product &y) {
+      return x.size() != y.size() ? x.size() < y.size() : x < y;
+    });
+    size_t count = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+      bool absorbed = false;
+      for (size_t k = 0; k < count && !absorbed; ++k) {
+        absorbed = std::includes(s[i].begin(), s[i].end(), s[k].begin(), s[k].end());
+      }
+      if (absorbed) continue;
+      if (count != i) s[count] = std::move(s[i]);
+      count++;
+    }
+    s.resize(count);
+
+    if (s.size() > SOP_MAX_PRODUCTS) fail("too many products");
+    if (!s.empty() && s.back().size() > SOP_LITERALS_LIMIT) fail("too many literals in a product");
+  }
+};
+
+#endif // CSG_SOP_H
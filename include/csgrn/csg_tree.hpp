@@ -5,67 +5,501 @@
 #include "csgrn/primitive.hpp"
 #include "glm/fwd.hpp"
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <vector>
 #include "csgrn/operations.hpp"
 #include "csgrn/op_instruction.hpp"
+#include "csgrn/csg_program.hpp"
+#include "csgrn/program_limits.hpp"
+#include "csgrn/bounds.hpp"
+#include "csgrn/bvh.hpp"
 
+// Index of a node inside a csg_tree
+using node_id = glm::uint;
+constexpr node_id null_node = 0xFFFFFFFFu;
+
+// Compact node record. Children are indices into the owning tree, and only
+// primitives carry attributes (transform and color), stored in side tables.
 struct csg_node {
-  csg_node *left = nullptr;
-  csg_node *right = nullptr;
+  node_id left = null_node;
+  node_id right = null_node;
  
   op_types op = op_types::op_none;
   primitive_types primitive = primitive_types::none;
-  glm::mat4x4 transform = glm::mat4(1.0f);
-  glm::vec3 color = glm::vec3(1.0f);
+  glm::uint attr = null_node; // index into csg_tree::transforms / colors
 
-  bool is_leave() {
-    return this->left==nullptr || this->right == nullptr;
+  bool is_leave() const {
+    return this->left==null_node || this->right == null_node;
   }
-
-  // Constructor for Operations
-    csg_node(op_types type, csg_node* l, csg_node* r) 
-        : op(type), left(l), right(r) {}
-
-    // Constructor for primitive
-    csg_node(primitive_types type) 
-        : primitive(type) {}
 };
 
+// Arena holding every node of a scene. Nodes are appended to one vector and
+// released all at once with the tree.
 class csg_tree {
   public:
-    csg_node root;
-    csg_tree(csg_node root) : root{root}{};
-    
-    glm::uint flatten_tree(csg_node* node, std::vector<primitive>& primitives, 
-                     std::vector<operation>& operations, 
-                    std::vector<instruction>& id_ops){
-      if (!node) return 255; // Safety check for null nodes
-
-      if(node->is_leave()){ // it's a primitive
-        glm::uint id = primitives.size();
-        id_ops.push_back({(glm::uint)node_type::PRIMITIVE, id}); // Create a PRIMITIVE instruction
-        primitive p;
-        material m;
-        m.albedo = glm::vec4(node->color, 1.0f);
-        m.spec = 0.0;
-        p.mat = m; // Assign the material
-        
-        p.transform = node->transform;
-        p.type = node->primitive;
-        primitives.push_back(p);
-        return id;
-      }
-
-      operation op;
-      op.type = (glm::uint)node->op;
-      op.operand1 = flatten_tree(node->left, primitives, operations, id_ops);
-      op.operand2 = flatten_tree(node->right, primitives, operations, id_ops);
-      glm::uint id = operations.size();
-      operations.push_back(op);
-      id_ops.push_back({(glm::uint)node_type::OPERATION, id}); // Create an OPERATION instruction
-      
-      return id;
-    }; 
+    std::vector<csg_node> nodes;
+    std::vector<glm::mat4> transforms; // world transform of each primitive
+    std::vector<glm::vec3> colors;     // albedo of each primitive
+    node_id root = null_node;
+
+    // Optional per-node choice of the operand flattened first, e.g. from a
+    // render profile (see csg_profile.hpp). Nodes left at null_node, or a
+    // vector that does not cover the tree, keep the Sethi-Ullman order.
+    std::vector<node_id> first_operand;
+
+    // Instruction range [begin, end) of every evaluated emission of a node,
+    // filled by flatten_tree() in emission order. `gate` is the index of the
+    // node's SKIP_IF_EMPTY/SKIP_IF_BEYOND instruction, or null_node.
+    struct node_range {
+      node_id node;
+      glm::uint begin, end, gate;
+    };
+    std::vector<node_range> node_ranges;
+
+    bool empty() const { return root == null_node; }
+
+    void reserve(size_t node_count) {
+      nodes.reserve(node_count);
+      transforms.reserve(node_count / 2 + 1);
+      colors.reserve(node_count / 2 + 1);
+    }
+
+    void clear() {
+      nodes.clear();
+      transforms.clear();
+      colors.clear();
+      first_operand.clear();
+      node_ranges.clear();
+      root = null_node;
+    }
+
+    csg_node& operator[](node_id id) { return nodes[id]; }
+    const csg_node& operator[](node_id id) const { return nodes[id]; }
+
+    node_id add_primitive(primitive_types type, const glm::mat4& transform = glm::mat4(1.0f)) {
+      csg_node node;
+      node.primitive = type;
+      node.attr = transforms.size();
+      transforms.push_back(transform);
+      colors.push_back(glm::vec3(1.0f));
+      nodes.push_back(node);
+      return nodes.size() - 1;
+    }
+
+    node_id add_operation(op_types type, node_id left, node_id right) {
+      csg_node node;
+      node.op = type;
+      node.left = left;
+      node.right = right;
+      nodes.push_back(node);
+      return nodes.size() - 1;
+    }
+
+    // World-space bounds of a subtree, as computed while flattening
+    aabb subtree_bounds(node_id id) {
+      if (id == null_node) return aabb();
+      if (node_boxes.size() != nodes.size()) compute_node_info();
+      return node_boxes[id];
+    }
+
+    // GPU record of leaf `id`: transforms and material
+    primitive to_primitive(node_id id) const {
+      const csg_node& node = nodes[id];
+      const glm::mat4& transform = transforms[node.attr];
+      primitive p{};
+      material m{};
+      m.albedo = glm::vec4(colors[node.attr], 1.0f);
+      m.spec = 0.0;
+      p.mat = m; // Assign the material
+
+      p.transform = transform;
+      p.inv_transform = glm::inverse(transform);
+      p.normal_matrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(transform))));
+      p.type = node.primitive;
+      return p;
+    }
+
+    // Children of the maximal `op` cluster rooted at `id`, left to right
+    void collect_cluster(node_id id, op_types op, std::vector<node_id>& parts) const {
+      if (id == null_node) return;
+      std::vector<node_id> pending{id};
+      while (!pending.empty()) {
+        node_id current = pending.back();
+        pending.pop_back();
+        const csg_node& node = nodes[current];
+        if (!node.is_leave() && node.op == op) {
+          pending.push_back(node.right);
+          pending.push_back(node.left);
+        } else {
+          parts.push_back(current);
+        }
+      }
+    }
+
+    // Flattens the whole tree. When the root is a union of at least
+    // BVH_MIN_ITEMS parts, the parts are grouped by a BVH instead: each leaf
+    // is flattened as a balanced union of its parts into its own instruction
+    // range, and program.bvh_nodes points at those ranges.
+    //
+    // The tree may be a DAG (see csg_simplify.hpp). A shared operation is
+    // evaluated once, kept in a slot with STORE and pushed again with LOAD;
+    // a shared primitive reuses its primitives[] entry. Slots never outlive
+    // a BVH leaf, since leaves run independently.
+    //
+    // Without `k_way` every operation is binary. k-way operations pay off
+    // where their operands are merged in one sweep (the generated evaluator,
+    // the CPU renderer); the interpreter folds them pairwise with all k
+    // operands live, while interleaved binary operations keep two.
+    glm::uint flatten_tree(csg_program& program, bool k_way = true){
+      k_way_operations = k_way;
+      compute_node_info();
+      emitted.assign(nodes.size(), null_node);
+      pending_uses.assign(nodes.size(), 0);
+      node_slot.assign(nodes.size(), null_node);
+      region_nodes.clear();
+      node_ranges.clear();
+
+      std::vector<node_id> parts;
+      collect_cluster(root, op_types::op_union, parts);
+      if (parts.size() < BVH_MIN_ITEMS) {
+        begin_region({root});
+        return flatten_node(root, program, true);
+      }
+
+      std::vector<bvh_item> items;
+      items.reserve(parts.size());
+      for (node_id part : parts) {
+        if (!node_boxes[part].empty()) items.push_back({node_boxes[part], part}); // empty parts never contribute
+      }
+      if (items.size() < BVH_MIN_ITEMS) {
+        begin_region({root});
+        return flatten_node(root, program, true);
+      }
+
+      bvh_builder bvh;
+      bvh.build(items);
+      glm::uint result = 0;
+      std::vector<node_id> leaf_parts;
+      for (bvh_node& node : bvh.nodes) {
+        if (node.count == 0) continue;
+        leaf_parts.clear();
+        for (glm::uint i = node.first; i < node.first + node.count; ++i) leaf_parts.push_back(items[i].id);
+        begin_region(leaf_parts);
+
+        glm::uint first = program.instructions.size();
+        result = flatten_union(items, node.first, node.first + node.count, program);
+        node.first = first;
+        node.count = program.instructions.size() - first;
+      }
+      program.bvh_nodes = std::move(bvh.nodes);
+      return result;
+    }
+
+  private:
+    // Per node, filled by compute_node_info(): stack entries needed to
+    // evaluate it in Sethi-Ullman order, and its world-space bounds
+    std::vector<glm::uint> stack_needs;
+    std::vector<aabb> node_boxes;
+
+    // Flattening state. emitted: primitive or operation id of each node's last
+    // emission. pending_uses: references left in the current region.
+    // node_slot: slot holding the node's result, if any.
+    std::vector<glm::uint> emitted;
+    std::vector<glm::uint> pending_uses;
+    std::vector<glm::uint> node_slot;
+    std::vector<node_id> region_nodes;
+    std::vector<glm::uint> free_slots;
+    glm::uint slot_count = 0;
+    size_t store_count = 0;
+    bool k_way_operations = true;
+
+    void compute_node_info() {
+      // Children are always added before their parent, so one forward pass
+      // sees every operand before the operation
+      stack_needs.assign(nodes.size(), 1);
+      node_boxes.assign(nodes.size(), aabb());
+      for (node_id id = 0; id < nodes.size(); ++id) {
+        const csg_node& node = nodes[id];
+        if (node.is_leave()) {
+          node_boxes[id] = primitive_bounds(node.primitive, transforms[node.attr]);
+          continue;
+        }
+        glm::uint l = stack_needs[node.left];
+        glm::uint r = stack_needs[node.right];
+        stack_needs[id] = l == r ? l + 1 : std::max(l, r);
+        node_boxes[id] = operation_bounds(node.op, node_boxes[node.left], node_boxes[node.right]);
+      }
+    }
+
+    // Counts the references to every node reachable from `roots`, expanding
+    // each shared node once, as flatten_node() will.
+    void begin_region(const std::vector<node_id>& roots) {
+      for (node_id id : region_nodes) {
+        pending_uses[id] = 0;
+        node_slot[id] = null_node;
+      }
+      region_nodes.clear();
+      free_slots.clear();
+      slot_count = 0;
+
+      std::vector<node_id> pending(roots.begin(), roots.end());
+      while (!pending.empty()) {
+        node_id id = pending.back();
+        pending.pop_back();
+        if (id == null_node) continue;
+        if (pending_uses[id]++ > 0) continue;
+        region_nodes.push_back(id);
+        const csg_node& node = nodes[id];
+        if (!node.is_leave()) {
+          pending.push_back(node.right);
+          pending.push_back(node.left);
+        }
+      }
+    }
+
+    void release_use(node_id id) {
+      if (pending_uses[id] > 0) pending_uses[id]--;
+      if (pending_uses[id] == 0 && node_slot[id] != null_node) {
+        free_slots.push_back(node_slot[id]);
+        node_slot[id] = null_node;
+      }
+    }
+
+    glm::uint acquire_slot() {
+      if (!free_slots.empty()) {
+        glm::uint slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+      }
+      if (slot_count < SHARED_SLOTS_LIMIT) return slot_count++;
+      return null_node; // out of slots: later references re-evaluate the node
+    }
+
+    // Emits a SKIP_IF_EMPTY or SKIP_IF_BEYOND placeholder between the two
+    // operands of an operation. Returns its index.
+    size_t open_gate(node_type type, csg_program& program) {
+      program.instructions.push_back({(glm::uint)type, 0});
+      return program.instructions.size() - 1;
+    }
+
+    // Removes a placeholder and moves the node_ranges recorded after it
+    void erase_instruction(size_t index, csg_program& program) {
+      program.instructions.erase(program.instructions.begin() + index);
+      for (size_t i = node_ranges.size(); i-- > 0 && node_ranges[i].end > index;) {
+        node_range& range = node_ranges[i];
+        if (range.begin > index) range.begin--;
+        if (range.gate != null_node && range.gate > index) range.gate--;
+        range.end--;
+      }
+    }
+
+    // Sets the gate's skip to cover the second operand and the operation, or
+    // removes it when that range holds a STORE. `second_box` is the box of the
+    // second operand, needed by SKIP_IF_BEYOND. Returns false if removed.
+    bool close_gate(size_t gate, size_t stores_before, const aabb& second_box, csg_program& program) {
+      if (store_count != stores_before) {
+        erase_instruction(gate, program);
+        return false;
+      }
+      instruction& inst = program.instructions[gate];
+      inst.skip = program.instructions.size() - gate - 1;
+      if (inst.type == (glm::uint)node_type::SKIP_IF_BEYOND) {
+        inst.id = program.node_bounds.size();
+        program.node_bounds.push_back(to_gpu_bounds(second_box));
+      }
+      return true;
+    }
+
+    // Flattens the subtree into RPN order. Every operation is preceded by a
+    // BOUNDS instruction holding the subtree's world-space box, so the shader
+    // can skip the whole subtree when a ray misses it. Between the operands,
+    // a gate lets the shader skip the second one when it cannot change the
+    // result: SKIP_IF_EMPTY after the minuend of a difference or the first
+    // operand of an intersection, SKIP_IF_BEYOND in unions on the root spine
+    // (`spine`), whose result is only used for the closest hit. Small
+    // clusters of intersections, or of unions off the spine, become one
+    // k-way operation (see flatten_cluster()). Returns the primitive or
+    // operation id.
+    glm::uint flatten_node(node_id id, csg_program& program, bool spine){
+      if (id == null_node) return 255; // Safety check for null nodes
+
+      if (node_slot[id] != null_node) { // evaluated earlier in this region
+        program.instructions.push_back({(glm::uint)node_type::LOAD, node_slot[id]});
+        release_use(id);
+        return emitted[id];
+      }
+
+      const csg_node& node = nodes[id];
+      if(node.is_leave()){ // it's a primitive
+        if (emitted[id] == null_node) {
+          emitted[id] = program.primitives.size();
+          program.primitives.push_back(to_primitive(id));
+        }
+        program.instructions.push_back({(glm::uint)node_type::PRIMITIVE, emitted[id]}); // Create a PRIMITIVE instruction
+        glm::uint at = program.instructions.size() - 1;
+        node_ranges.push_back({id, at, at + 1, null_node});
+        release_use(id);
+        return emitted[id];
+      }
+
+      // Placeholder BOUNDS instruction, patched once the subtree is emitted
+      size_t guard = program.instructions.size();
+      size_t stores_before = store_count;
+      program.instructions.push_back({(glm::uint)node_type::BOUNDS, 0});
+
+      std::vector<node_id> parts;
+      bool profiled = id < first_operand.size() && first_operand[id] != null_node;
+      if (k_way_operations && !profiled &&
+          (node.op == op_types::op_intersection || (node.op == op_types::op_union && !spine))) {
+        collect_operands(id, node.op, parts);
+      }
+      glm::uint op_id;
+      glm::uint range_gate = null_node;
+      if (parts.size() > 2 && parts.size() <= MAX_OPERANDS) {
+        op_id = flatten_cluster(node.op, parts, program);
+      } else {
+        op_id = flatten_operation(id, spine, program, range_gate);
+      }
+      node_ranges.push_back({id, (glm::uint)guard, (glm::uint)program.instructions.size(), range_gate});
+
+      if (store_count != stores_before) {
+        // Skipping would also skip a STORE that later LOADs rely on
+        erase_instruction(guard, program);
+      } else {
+        program.instructions[guard].id = program.node_bounds.size();
+        program.instructions[guard].skip = program.instructions.size() - guard - 1;
+        program.node_bounds.push_back(to_gpu_bounds(node_boxes[id]));
+      }
+      emitted[id] = op_id;
+
+      // Keep the result for the remaining references
+      if (pending_uses[id] > 1) {
+        glm::uint slot = acquire_slot();
+        if (slot != null_node) {
+          program.instructions.push_back({(glm::uint)node_type::STORE, slot});
+          node_slot[id] = slot;
+          store_count++;
+        }
+      }
+      release_use(id);
+      return op_id;
+    }
+
+    // Operands and OPERATION of binary node `id`. `range_gate` receives the
+    // index of the gate between the operands, if one is kept.
+    glm::uint flatten_operation(node_id id, bool spine, csg_program& program, glm::uint& range_gate) {
+      const csg_node& node = nodes[id];
+
+      // Sethi-Ullman order: the operand needing the deeper stack goes first,
+      // so its result is the only entry held while the other one is built
+      bool right_first = stack_needs[node.right] > stack_needs[node.left];
+      if (id < first_operand.size() && first_operand[id] != null_node) right_first = first_operand[id] == node.right;
+
+      node_id first = right_first ? node.right : node.left;
+      node_id second = right_first ? node.left : node.right;
+      bool child_spine = spine && node.op == op_types::op_union;
+
+      glm::uint first_id = flatten_node(first, program, child_spine);
+
+      bool skip_if_empty = node.op == op_types::op_intersection ||
+                           (node.op == op_types::op_difference && !right_first);
+      bool gated = skip_if_empty || child_spine;
+      size_t gate = 0;
+      size_t stores_before_gate = store_count;
+      if (gated) gate = open_gate(skip_if_empty ? node_type::SKIP_IF_EMPTY : node_type::SKIP_IF_BEYOND, program);
+
+      glm::uint second_id = flatten_node(second, program, child_spine);
+
+      operation op{};
+      op.type = (glm::uint)node.op;
+      op.operand1 = right_first ? second_id : first_id;
+      op.operand2 = right_first ? first_id : second_id;
+      if (right_first && node.op == op_types::op_difference) op.type = (glm::uint)op_types::op_reverse_difference;
+      glm::uint op_id = program.operations.size();
+      program.operations.push_back(op);
+      program.instructions.push_back({(glm::uint)node_type::OPERATION, op_id}); // Create an OPERATION instruction
+      if (gated && close_gate(gate, stores_before_gate, node_boxes[second], program)) range_gate = gate;
+      return op_id;
+    }
+
+    // Operands of the `op` cluster rooted at `id`: like collect_cluster(),
+    // but shared nodes stay whole so they are still evaluated once
+    void collect_operands(node_id id, op_types op, std::vector<node_id>& parts) const {
+      std::vector<node_id> pending{nodes[id].right, nodes[id].left};
+      while (!pending.empty()) {
+        node_id current = pending.back();
+        pending.pop_back();
+        const csg_node& node = nodes[current];
+        if (!node.is_leave() && node.op == op && pending_uses[current] <= 1 &&
+            !(current < first_operand.size() && first_operand[current] != null_node)) {
+          pending.push_back(node.right);
+          pending.push_back(node.left);
+        } else {
+          parts.push_back(current);
+        }
+      }
+    }
+
+    // Union or intersection of up to MAX_OPERANDS parts as one k-way
+    // operation: one instruction, and in the generated evaluator one sweep
+    // over all operands, instead of a binary merge per part. Larger clusters
+    // stay binary, keeping the BOUNDS guard of every subtree, until their
+    // subtrees are small enough. Parts are ordered by
+    // stack need (Sethi-Ullman for k operands). In an intersection, a
+    // SKIP_IF_EMPTY after every operand but the last ends the operation as
+    // soon as one is empty, dropping the operands already pushed.
+    glm::uint flatten_cluster(op_types type, std::vector<node_id>& parts, csg_program& program) {
+      std::stable_sort(parts.begin(), parts.end(),
+                       [&](node_id a, node_id b) { return stack_needs[a] > stack_needs[b]; });
+
+      struct open { size_t gate, stores_before; };
+      std::vector<open> gates;
+
+      operation op{};
+      op.type = (glm::uint)type;
+      op.count = parts.size();
+      for (size_t i = 0; i < parts.size(); ++i) {
+        if (i > 0 && type == op_types::op_intersection) {
+          gates.push_back({open_gate(node_type::SKIP_IF_EMPTY, program), store_count});
+          program.instructions.back().id = i - 1;
+        }
+        glm::uint part_id = flatten_node(parts[i], program, false);
+        if (i == 0) op.operand1 = part_id;
+        op.operand2 = part_id;
+      }
+      glm::uint op_id = program.operations.size();
+      program.operations.push_back(op);
+      program.instructions.push_back({(glm::uint)node_type::OPERATION, op_id});
+
+      // Later gates first, so erasing one does not move the others
+      for (size_t g = gates.size(); g-- > 0;) {
+        close_gate(gates[g].gate, gates[g].stores_before, aabb(), program);
+      }
+      return op_id;
+    }
+
+    // Balanced union of items[begin, end). BVH leaves feed the closest hit
+    // directly, so they are on the root spine.
+    glm::uint flatten_union(const std::vector<bvh_item>& items, size_t begin, size_t end,
+                            csg_program& program) {
+      if (end - begin == 1) return flatten_node(items[begin].id, program, true);
+
+      size_t mid = begin + (end - begin) / 2;
+      operation op{};
+      op.type = (glm::uint)op_types::op_union;
+      op.operand1 = flatten_union(items, begin, mid, program);
+      size_t stores_before_gate = store_count;
+      size_t gate = open_gate(node_type::SKIP_IF_BEYOND, program);
+      op.operand2 = flatten_union(items, mid, end, program);
+      glm::uint op_id = program.operations.size();
+      program.operations.push_back(op);
+      program.instructions.push_back({(glm::uint)node_type::OPERATION, op_id});
+
+      aabb second_box;
+      for (size_t i = mid; i < end; ++i) second_box = aabb::merge(second_box, items[i].box);
+      close_gate(gate, stores_before_gate, second_box, program);
+      return op_id;
+    }
 };
 
 #endif // !CSG_TREE_H
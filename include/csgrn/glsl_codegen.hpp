@@ -0,0 +1,136 @@
+#ifndef GLSL_CODEGEN_H
+#define GLSL_CODEGEN_H
+
+#include "csgrn/csg_program.hpp"
+#include "csgrn/program_limits.hpp"
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Scenes above this size stay on the generic interpreter: the generated
+// source grows linearly with the scene and so does the driver compile time.
+constexpr size_t CODEGEN_MAX_INSTRUCTIONS = 512;
+
+// Emits a straight-line evaluate_scene() for raytracer.glsl. Every primitive
+// becomes a direct call to its intersector and every operation a merge_into()
+// with a constant op and constant span pool lists. This removes the
+// instruction fetch, the type switch and the dynamically indexed stack of the
+// interpreter. Returns an empty string if the program cannot be compiled.
+//
+// The instruction stream is the tree in post-order, so walking it is the
+// same as walking the csg_node tree, and it also works for .csgb scenes.
+// Scenes with a top-level BVH are left to the interpreter's traversal.
+inline std::string generate_glsl_evaluator(const csg_program_view &program) {
+  if (program.instructions.empty() || !program.bvh_nodes.empty()) return "";
+  program_limits limits = compute_program_limits(program);
+  if (!limits.valid || limits.stack_overflows()) return "";
+
+  std::ostringstream out;
+  std::ostringstream body;
+  int sp = 0;
+  glm::uint shared_slots = 0; // SLOT_LIST(0..N), written by STORE
+
+  // Pool list of each stack position and the spare, as in the interpreter,
+  // but resolved here so every list index in the output is a constant
+  std::vector<int> list_at(limits.stack_depth);
+  for (size_t k = 0; k < list_at.size(); ++k) list_at[k] = (int)k;
+  int spare = (int)limits.stack_depth;
+
+  // Open BOUNDS and SKIP_IF_* blocks: index of the last instruction they
+  // cover, the stack position of their result and the list it was in when
+  // the block opened. Skipping a block must leave the same result in the
+  // list the executed path ends with.
+  struct guard { size_t end; glm::uint type; int position; int list; };
+  std::vector<guard> guards;
+
+  for (size_t i = 0; i < program.instructions.size(); ++i) {
+    const instruction &inst = program.instructions[i];
+    if (inst.type == (glm::uint)node_type::BOUNDS) {
+      if (inst.id >= program.node_bounds.size() || sp >= (int)list_at.size()) return "";
+      body << "  if (hit_bounds(r, inv_dir, " << inst.id << "u)) {\n";
+      guards.push_back({i + inst.skip, inst.type, sp, list_at[sp]});
+    } else if (inst.type == (glm::uint)node_type::SKIP_IF_EMPTY) {
+      // A k-way intersection's result replaces the inst.id operands below
+      if (sp < 1 + (int)inst.id) return "";
+      body << "  if (pool_count[" << list_at[sp - 1] << "] != 0) {\n";
+      guards.push_back({i + inst.skip, inst.type, sp - 1 - (int)inst.id, list_at[sp - 1]});
+    } else if (inst.type == (glm::uint)node_type::SKIP_IF_BEYOND) {
+      if (sp < 1 || inst.id >= program.node_bounds.size()) return "";
+      body << "  if (!(bounds_entry(r, inv_dir, " << inst.id << "u) > first_visible_entry("
+           << list_at[sp - 1] << "))) {\n";
+      guards.push_back({i + inst.skip, inst.type, sp - 1, list_at[sp - 1]});
+    } else if (inst.type == (glm::uint)node_type::PRIMITIVE) {
+      if (inst.id >= program.primitives.size() || sp >= (int)list_at.size()) return "";
+      const char *intersector = nullptr;
+      switch (program.primitives[inst.id].type) {
+      case primitive_types::sphere: intersector = "intersect_unit_sphere"; break;
+      case primitive_types::cube: intersector = "intersect_box_AABB"; break;
+      case primitive_types::cylinder: intersector = "intersect_cylinder"; break;
+      default: break;
+      }
+      body << "  set_primitive(" << list_at[sp] << ", ";
+      if (intersector) {
+        body << intersector << "(to_object_space(" << inst.id << "u, r))";
+      } else {
+        body << "NO_HIT_SPAN";
+      }
+      body << ", " << inst.id << "u);\n";
+      sp++;
+    } else if (inst.type == (glm::uint)node_type::STORE) {
+      if (sp < 1 || inst.id >= SHARED_SLOTS_LIMIT) return "";
+      body << "  copy_list(SLOT_LIST(" << inst.id << "), " << list_at[sp - 1] << ");\n";
+      shared_slots = std::max<glm::uint>(shared_slots, inst.id + 1);
+    } else if (inst.type == (glm::uint)node_type::LOAD) {
+      if (inst.id >= shared_slots || sp >= (int)list_at.size()) return "";
+      body << "  copy_list(" << list_at[sp] << ", SLOT_LIST(" << inst.id << "));\n";
+      sp++;
+    } else if (inst.type == (glm::uint)node_type::OPERATION) {
+      if (inst.id >= program.operations.size()) return "";
+      const operation &op = program.operations[inst.id];
+      if (op.count < 2 || op.count > MAX_OPERANDS || sp < (int)op.count) return "";
+      sp -= op.count - 1;
+      glm::uint type = op.type;
+      int a = list_at[sp - 1];
+      int b = list_at[sp];
+      if (op.count > 2) {
+        body << "  merge_many(" << spare << ", int[MAX_OPERANDS](";
+        for (glm::uint k = 0; k < MAX_OPERANDS; ++k) {
+          body << (k ? ", " : "") << (k < op.count ? list_at[sp - 1 + k] : 0);
+        }
+        body << "), " << op.count << ", " << type << ");\n";
+      } else if (type == (glm::uint)op_types::op_reverse_difference) {
+        body << "  merge_into(" << spare << ", " << b << ", " << a << ", "
+             << (glm::uint)op_types::op_difference << ");\n";
+      } else {
+        body << "  merge_into(" << spare << ", " << a << ", " << b << ", " << type << ");\n";
+      }
+      list_at[sp - 1] = spare;
+      spare = a;
+    } else {
+      return "";
+    }
+
+    while (!guards.empty() && guards.back().end == i) {
+      const guard &g = guards.back();
+      if (sp != g.position + 1) return "";
+      int result = list_at[g.position];
+      if (g.type == (glm::uint)node_type::SKIP_IF_BEYOND) {
+        // The first operand stays the result
+        if (result != g.list) body << "  } else {\n    copy_list(" << result << ", " << g.list << ");\n";
+      } else {
+        body << "  } else {\n    pool_count[" << result << "] = 0;\n";
+      }
+      body << "  }\n";
+      guards.pop_back();
+    }
+  }
+  if (sp != 1 || !guards.empty()) return "";
+
+  out << "#define CSGRN_GENERATED_EVALUATOR\n"
+      << "bool evaluate_scene(ray r, out span hit) {\n"
+      << "  vec3 inv_dir = 1.0 / r.dir;\n"
+      << body.str() << "  return first_visible_span(" << list_at[0] << ", hit);\n}\n";
+  return out.str();
+}
+
+#endif // GLSL_CODEGEN_H
@@ -0,0 +1,118 @@
+#ifndef HEADLESS_CONTEXT_H
+#define HEADLESS_CONTEXT_H
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+#include <iostream>
+
+// Window-less GL 4.6 core context through EGL. Prefers Mesa's surfaceless
+// platform so it works on machines without a display (llvmpipe included);
+// falls back to the default EGL display otherwise.
+class headless_context {
+public:
+  headless_context() = default;
+  headless_context(const headless_context &) = delete;
+  headless_context &operator=(const headless_context &) = delete;
+
+  ~headless_context() { destroy(); }
+
+  bool create(int major = 4, int minor = 6) {
+    display = get_display();
+    if (display == EGL_NO_DISPLAY) {
+      std::cerr << "[ERROR] EGL: no display available" << std::endl;
+      return false;
+    }
+
+    EGLint egl_major, egl_minor;
+    if (!eglInitialize(display, &egl_major, &egl_minor)) {
+      std::cerr << "[ERROR] EGL: eglInitialize failed (0x" << std::hex
+                << eglGetError() << std::dec << ")" << std::endl;
+      display = EGL_NO_DISPLAY;
+      return false;
+    }
+
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!has_extension(extensions, "EGL_KHR_surfaceless_context")) {
+      std::cerr << "[ERROR] EGL: EGL_KHR_surfaceless_context is not supported" << std::endl;
+      return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+      std::cerr << "[ERROR] EGL: desktop OpenGL is not supported" << std::endl;
+      return false;
+    }
+
+    // Rendering goes to a texture, so any OpenGL-capable config will do
+    EGLConfig config = nullptr;
+    EGLint num_configs = 0;
+    const EGLint config_attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+      if (!has_extension(extensions, "EGL_KHR_no_config_context")) {
+        std::cerr << "[ERROR] EGL: no OpenGL config available" << std::endl;
+        return false;
+      }
+      config = EGL_NO_CONFIG_KHR;
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, major,
+        EGL_CONTEXT_MINOR_VERSION, minor,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE};
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT) {
+      std::cerr << "[ERROR] EGL: could not create a GL " << major << "." << minor
+                << " core context (0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+      return false;
+    }
+
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+      std::cerr << "[ERROR] EGL: eglMakeCurrent failed" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  void destroy() {
+    if (display == EGL_NO_DISPLAY) return;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+    eglTerminate(display);
+    display = EGL_NO_DISPLAY;
+    context = EGL_NO_CONTEXT;
+  }
+
+  // Loader for gladLoadGLLoader
+  static void *get_proc_address(const char *name) {
+    return reinterpret_cast<void *>(eglGetProcAddress(name));
+  }
+
+private:
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLContext context = EGL_NO_CONTEXT;
+
+  static bool has_extension(const char *list, const char *name) {
+    if (!list) return false;
+    size_t len = std::strlen(name);
+    for (const char *p = list; (p = std::strstr(p, name)) != nullptr; p += len) {
+      if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return true;
+    }
+    return false;
+  }
+
+  static EGLDisplay get_display() {
+    const char *client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (has_extension(client, "EGL_MESA_platform_surfaceless")) {
+      auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+          eglGetProcAddress("eglGetPlatformDisplayEXT"));
+      if (get_platform_display) {
+        EGLDisplay d = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (d != EGL_NO_DISPLAY) return d;
+      }
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+};
+
+#endif // HEADLESS_CONTEXT_H
@@ -0,0 +1,66 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <stb_image_write.h>
+#include <string>
+#include <vector>
+
+// Writes RGBA float pixels (rows bottom to top, as read back from GL) to a
+// .png (8-bit, gamma untouched) or .pfm (32-bit float RGB) file.
+
+inline bool write_pfm(const std::string &path, const std::vector<float> &rgba,
+                      int width, int height) {
+  FILE *f = std::fopen(path.c_str(), "wb");
+  if (!f) {
+    std::cerr << "Error: Could not open " << path << " for writing" << std::endl;
+    return false;
+  }
+  // Negative scale = little endian; PFM rows are stored bottom to top
+  std::fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+  std::vector<float> row((size_t)width * 3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const float *px = &rgba[((size_t)y * width + x) * 4];
+      row[x * 3 + 0] = px[0];
+      row[x * 3 + 1] = px[1];
+      row[x * 3 + 2] = px[2];
+    }
+    std::fwrite(row.data(), sizeof(float), row.size(), f);
+  }
+  bool ok = std::ferror(f) == 0;
+  std::fclose(f);
+  return ok;
+}
+
+inline bool write_png(const std::string &path, const std::vector<float> &rgba,
+                      int width, int height) {
+  std::vector<uint8_t> pixels((size_t)width * height * 4);
+  for (int y = 0; y < height; ++y) {
+    // PNG rows go top to bottom
+    const float *src = &rgba[(size_t)(height - 1 - y) * width * 4];
+    uint8_t *dst = &pixels[(size_t)y * width * 4];
+    for (int i = 0; i < width * 4; ++i) {
+      dst[i] = (uint8_t)(std::clamp(src[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+  }
+  if (!stbi_write_png(path.c_str(), width, height, 4, pixels.data(), width * 4)) {
+    std::cerr << "Error: Failed writing " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline bool write_image(const std::string &path, const std::vector<float> &rgba,
+                        int width, int height) {
+  if (std::filesystem::path(path).extension() == ".pfm") {
+    return write_pfm(path, rgba, width, height);
+  }
+  return write_png(path, rgba, width, height);
+}
+
+#endif // IMAGE_IO_H
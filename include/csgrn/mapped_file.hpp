@@ -0,0 +1,94 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file. The mapping lives as long as the
+// object, so string_views into it stay valid until it is destroyed.
+class mapped_file {
+public:
+  mapped_file() = default;
+
+  explicit mapped_file(const std::string &path) { open(path); }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  mapped_file(mapped_file &&other) noexcept
+      : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  mapped_file &operator=(mapped_file &&other) noexcept {
+    if (this != &other) {
+      close();
+      data_ = other.data_;
+      size_ = other.size_;
+      other.data_ = nullptr;
+      other.size_ = 0;
+    }
+    return *this;
+  }
+
+  ~mapped_file() { close(); }
+
+  bool open(const std::string &path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Error: Could not open file at " << path << std::endl;
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      std::cerr << "Error: Could not stat file at " << path << std::endl;
+      ::close(fd);
+      return false;
+    }
+
+    if (st.st_size > 0) {
+      void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr == MAP_FAILED) {
+        std::cerr << "Error: Could not map file at " << path << std::endl;
+        ::close(fd);
+        return false;
+      }
+      madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+      data_ = static_cast<const char *>(ptr);
+      size_ = static_cast<size_t>(st.st_size);
+    }
+
+    // The mapping keeps its own reference to the file.
+    ::close(fd);
+    return true;
+  }
+
+  void close() {
+    if (data_) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::string_view view() const { return std::string_view(data_, size_); }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+#endif // MAPPED_FILE_H
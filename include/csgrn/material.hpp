@@ -6,9 +6,9 @@
 struct alignas(16) material {
   glm::vec4 albedo;
   float spec;
-  float _padding1;
-  float _padding2;
-  float _padding3;
+  float _padding1 = 0.0f;
+  float _padding2 = 0.0f;
+  float _padding3 = 0.0f;
 };
 
 #endif // !MATERIAL_H
@@ -5,13 +5,24 @@
 
 enum class node_type {
     PRIMITIVE,
-    OPERATION
+    OPERATION,
+    BOUNDS,     // id: bounds index. On a miss, push an empty list and skip the subtree.
+                // With skip 0 on an empty box it only pushes an empty list
+    STORE,      // id: slot. Copies the top of the stack into the slot, leaving it in place
+    LOAD,       // id: slot. Pushes a copy of the slot
+    SKIP_IF_EMPTY,  // id: entries below the top to drop. Skips the next `skip` instructions
+                    // if the top of the stack is empty, leaving one empty entry in place of
+                    // the top `id + 1` (the operands of a k-way intersection pushed so far)
+    SKIP_IF_BEYOND  // id: bounds index. Skips the next `skip` instructions if the box
+                    // starts past the first visible entry of the top of the stack
 };
 
 // Represents a single instruction for the GPU to execute when evaluating the CSG tree
 struct alignas(16) instruction {
     glm::uint type;
     glm::uint id;
+    glm::uint skip = 0; // BOUNDS, SKIP_IF_*: number of instructions jumped over
+    glm::uint padding = 0;
 };
 
 #endif // OP_INSTRUCTION_H
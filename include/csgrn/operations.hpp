@@ -4,19 +4,31 @@
 #include <glm/glm.hpp>
 #include <string>
 
-enum class op_types { op_none=0, op_union = 1, op_intersection = 2, op_difference = 4 };
+// op_reverse_difference only appears in flattened programs: a difference
+// whose subtrahend was emitted first, so the result is op2 - op1 on the stack.
+enum class op_types { op_none=0, op_union = 1, op_intersection = 2, op_difference = 4,
+                      op_reverse_difference = 8 };
 
-// Operation always defined between 2 operands ids.
+// Most operands one merge may take, see operation::count
+constexpr glm::uint MAX_OPERANDS = 8;
+
+// Operation on the top `count` entries of the stack. Binary operations have
+// count 2 and operand1/operand2 are their operand ids. A union or
+// intersection of up to MAX_OPERANDS operands is merged in one sweep instead
+// of a chain of binary merges; operand1/operand2 are then its first and last
+// operand.
 struct alignas(16) operation {
   glm::uint type;
   glm::uint operand1;
   glm::uint operand2;
+  glm::uint count = 2;
 
   static std::string get_op_name(op_types type) {
     switch (type) {
       case op_types::op_union: return "Union";
       case op_types::op_intersection: return "Intersection";
       case op_types::op_difference: return "Difference";
+      case op_types::op_reverse_difference: return "Reverse difference";
       default: return "Unknown ()";
     }
   }
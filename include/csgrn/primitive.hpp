@@ -14,8 +14,11 @@ enum class primitive_types {
 // Use alignas to be safe
 struct alignas(16) primitive {
     primitive_types type;  // 4 byte
+    glm::uint _padding1 = 0, _padding2 = 0, _padding3 = 0; // up to the 16 byte aligned material
     material mat; 
     glm::mat4 transform;
+    glm::mat4 inv_transform;  // world -> object, precomputed at flatten time
+    glm::mat4 normal_matrix;  // transpose(inverse(mat3(transform))), stored as mat4 for std140
 };
 
 #endif // PRIMITIVE_H
@@ -0,0 +1,169 @@
+#ifndef PROGRAM_LIMITS_H
+#define PROGRAM_LIMITS_H
+
+#include "csgrn/csg_program.hpp"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Hard caps on the per-invocation private memory of the ray tracer
+constexpr glm::uint MAX_SPANS_LIMIT = 32;
+constexpr glm::uint STACK_SIZE_LIMIT = 64;
+constexpr glm::uint SHARED_SLOTS_LIMIT = 8; // results kept by STORE for later LOADs
+
+// Sizes the ray tracer needs for one scene: the deepest RPN stack and the
+// largest interval list any stack entry can hold. They become the shader's
+// STACK_SIZE, MAX_SPANS and SHARED_SLOTS defines. A sum-of-products program
+// only needs SOP_LITERALS, the longest product.
+struct program_limits {
+  glm::uint stack_depth = 1;
+  glm::uint shared_slots = 0;
+  glm::uint max_spans = 1;
+  glm::uint required_spans = 1; // before clamping to MAX_SPANS_LIMIT
+  glm::uint sop_literals = 0;   // 0 unless the program is in sum-of-products form
+  bool valid = true;            // false if the stream under/overflows
+
+  bool spans_truncated() const { return required_spans > max_spans; }
+  bool stack_overflows() const { return stack_depth > STACK_SIZE_LIMIT; }
+
+  // GLSL defines selecting the matching shader variant. SHARED_SLOTS is left
+  // out when no slot is used, so the slot array is not compiled in at all.
+  std::string defines() const {
+    std::string out = "#define MAX_SPANS " + std::to_string(max_spans) + "\n" +
+                      "#define STACK_SIZE " + std::to_string(std::max(stack_depth, 1u)) + "\n";
+    if (shared_slots > 0) out += "#define SHARED_SLOTS " + std::to_string(shared_slots) + "\n";
+    if (sop_literals > 0) out += "#define SOP_LITERALS " + std::to_string(sop_literals) + "\n";
+    return out;
+  }
+};
+
+inline glm::uint round_up_pow2(glm::uint v) {
+  glm::uint p = 1;
+  while (p < v) p <<= 1;
+  return p;
+}
+
+// Upper bound on the spans produced by merging lists of a and b spans.
+// Every primitive is convex, so it contributes exactly one span.
+inline glm::uint merged_span_bound(glm::uint op, glm::uint a, glm::uint b) {
+  if (op == (glm::uint)op_types::op_reverse_difference) {
+    std::swap(a, b);
+    op = (glm::uint)op_types::op_difference;
+  }
+  if (op == (glm::uint)op_types::op_intersection) {
+    return (a == 0 || b == 0) ? 0 : a + b - 1;
+  }
+  if (op == (glm::uint)op_types::op_difference) {
+    return a == 0 ? 0 : a + b;
+  }
+  return a + b; // union
+}
+
+// Simulates the instruction stream to find the stack depth and span bound.
+// With a BVH every leaf range runs on its own, starting from an empty stack.
+inline program_limits compute_program_limits(const csg_program_view &program) {
+  program_limits limits;
+  if (!program.products.empty()) {
+    // The result is a single hit, no interval list is merged
+    for (const sop_product &p : program.products) {
+      if (p.first > program.literals.size() || p.count > program.literals.size() - p.first ||
+          p.count == 0 || p.count > SOP_LITERALS_LIMIT) {
+        limits.valid = false;
+        return limits;
+      }
+      limits.sop_literals = std::max(limits.sop_literals, p.count);
+    }
+    for (glm::uint literal : program.literals) {
+      if (sop_literal_primitive(literal) >= program.primitives.size()) limits.valid = false;
+    }
+    return limits;
+  }
+
+  std::vector<glm::uint> spans; // span bound of each live stack entry
+  std::vector<glm::uint> slots; // span bound of each stored slot
+  glm::uint required = 1;
+
+  std::vector<bool> range_start(program.instructions.size(), false);
+  for (const bvh_node &node : program.bvh_nodes) {
+    if (node.count == 0) continue;
+    if (node.first >= range_start.size() || node.count > range_start.size() - node.first) {
+      limits.valid = false;
+      return limits;
+    }
+    range_start[node.first] = true;
+  }
+
+  for (size_t i = 0; i < program.instructions.size(); ++i) {
+    const instruction &inst = program.instructions[i];
+    if (range_start[i]) spans.clear();
+
+    if (inst.type == (glm::uint)node_type::PRIMITIVE) {
+      spans.push_back(1);
+    } else if (inst.type == (glm::uint)node_type::BOUNDS && inst.skip == 0) {
+      spans.push_back(0); // an empty box guarding nothing: pushes an empty list
+    } else if (inst.type == (glm::uint)node_type::OPERATION) {
+      if (inst.id >= program.operations.size()) {
+        limits.valid = false;
+        break;
+      }
+      const operation &op = program.operations[inst.id];
+      if (op.count < 2 || op.count > MAX_OPERANDS || spans.size() < op.count ||
+          (op.count > 2 && op.type != (glm::uint)op_types::op_union &&
+           op.type != (glm::uint)op_types::op_intersection)) {
+        limits.valid = false;
+        break;
+      }
+      // A k-way merge bounds like the chain of binary merges it replaces
+      glm::uint merged = spans[spans.size() - op.count];
+      for (size_t k = spans.size() - op.count + 1; k < spans.size(); ++k) {
+        merged = merged_span_bound(op.type, merged, spans[k]);
+      }
+      spans.resize(spans.size() - op.count);
+      required = std::max(required, merged);
+      spans.push_back(std::min(merged, MAX_SPANS_LIMIT * 2)); // keep the bound from overflowing
+    } else if (inst.type == (glm::uint)node_type::STORE) {
+      if (spans.empty() || inst.id >= SHARED_SLOTS_LIMIT) {
+        limits.valid = false;
+        break;
+      }
+      if (slots.size() <= inst.id) slots.resize(inst.id + 1, 0);
+      slots[inst.id] = spans.back();
+      limits.shared_slots = std::max<glm::uint>(limits.shared_slots, inst.id + 1);
+    } else if (inst.type == (glm::uint)node_type::LOAD) {
+      if (inst.id >= slots.size()) {
+        limits.valid = false;
+        break;
+      }
+      spans.push_back(slots[inst.id]);
+    }
+    limits.stack_depth = std::max<glm::uint>(limits.stack_depth, spans.size());
+  }
+
+  limits.required_spans = required;
+  // Powers of two keep the number of distinct shader variants small
+  limits.max_spans = std::min(round_up_pow2(required), MAX_SPANS_LIMIT);
+  return limits;
+}
+
+inline void print_program_limits(const program_limits &limits) {
+  if (limits.sop_literals > 0) {
+    std::cout << "[LIMITS] sum of products, up to " << limits.sop_literals << " literals per product\n";
+  } else {
+    std::cout << "[LIMITS] stack depth " << limits.stack_depth << ", spans "
+              << limits.max_spans << " (needed " << limits.required_spans << ")\n";
+  }
+  if (!limits.valid) {
+    std::cerr << "[ERROR] Instruction stream is malformed (stack underflow or bad slot)" << std::endl;
+  }
+  if (limits.spans_truncated()) {
+    std::cerr << "[WARNING] Scene may need " << limits.required_spans
+              << " spans per list, truncating to " << limits.max_spans << std::endl;
+  }
+  if (limits.stack_overflows()) {
+    std::cerr << "[WARNING] Scene needs a stack of " << limits.stack_depth
+              << " entries, more than the supported " << STACK_SIZE_LIMIT << std::endl;
+  }
+}
+
+#endif // PROGRAM_LIMITS_H
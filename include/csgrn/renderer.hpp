@@ -0,0 +1,385 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "csgrn/compute_shader.hpp"
+#include "csgrn/csg_program.hpp"
+#include "csgrn/program_limits.hpp"
+#include "csgrn/glsl_codegen.hpp"
+#include "csgrn/screen_rect.hpp"
+#include "csgrn/tile_programs.hpp"
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+const int LOCAL_SIZE_X = 8;
+const int LOCAL_SIZE_Y = 8; // square workgroups, see render()
+const glm::vec4 BACKGROUND_COLOR(0.5f, 0.7f, 1.0f, 1.0f); // the sky of raytracer.glsl's main()
+
+// How the shader evaluates the CSG program
+enum class evaluator_mode {
+  automatic,   // generated code for small scenes, interpreter otherwise
+  interpreted, // generic loop over the instructions SSBO
+  generated,   // straight-line GLSL emitted for this scene
+  profiled,    // interpreter counting every instruction, see read_profile()
+  tiled        // interpreter running per-tile pruned programs, see tile_programs.hpp
+};
+
+// Owns the GPU side of the ray tracer: the scene SSBOs, the output texture
+// and the compute dispatch. Needs a current GL 4.6 context, windowed or not.
+// Each frame only dispatches the workgroups covered by the projected box of
+// the scene; the rest of the image is cleared to the background.
+// With gpu_binning, a prepass (binning.glsl) masks out, per workgroup, the
+// primitives whose box misses its frustum whenever the view changes. With
+// staged_program, the interpreter's workgroups read the program from shared
+// memory (STAGED_PROGRAM in raytracer.glsl). With subgroup_culling, its bound
+// tests skip only when the whole subgroup agrees; subgroup_stats also counts
+// how often, see print_subgroup_stats().
+// Shader variants come from `variants`, which must outlive the renderer so
+// that later renderers reuse what earlier ones compiled.
+class renderer {
+public:
+  int width;
+  int height;
+  unsigned int texture_out;
+
+  renderer(shader_variant_cache &variants, const csg_program_view &scene, int width, int height,
+           evaluator_mode mode = evaluator_mode::automatic, bool gpu_binning = false,
+           bool staged_program = false, bool subgroup_culling = false, bool subgroup_stats = false,
+           const char *binning_path = "src/shaders/binning.glsl")
+      : width(width), height(height), scene(scene), variants(variants) {
+
+    // Size the span lists and the RPN stack for this scene
+    limits = compute_program_limits(scene);
+    print_program_limits(limits);
+
+    std::string defines = limits.defines();
+    if (mode == evaluator_mode::profiled) defines += "#define CSGRN_PROFILE\n";
+    gpu_binning = gpu_binning && !scene.primitives.empty();
+    if (gpu_binning) defines += "#define GPU_BINNING\n";
+    bool tiled = mode == evaluator_mode::tiled && scene.products.empty() && limits.valid;
+    if (tiled) {
+      defines += "#define TILE_PROGRAMS\n#define TILE_SIZE " + std::to_string(TILE_PROGRAM_SIZE) + "\n";
+    }
+
+    std::string evaluator;
+    if (mode == evaluator_mode::generated ||
+        (mode == evaluator_mode::automatic &&
+         scene.instructions.size() <= CODEGEN_MAX_INSTRUCTIONS)) {
+      evaluator = generate_glsl_evaluator(scene);
+    }
+    // The interpreter can stage the program in shared memory per workgroup.
+    // BVH traversal runs different leaves per ray, which the staging cannot
+    // share.
+    if (staged_program) {
+      if (evaluator.empty() && scene.products.empty() && scene.bvh_nodes.empty()) {
+        defines += "#define STAGED_PROGRAM\n";
+        std::cout << "[RENDERER] Program staged in shared memory\n";
+      } else {
+        std::cout << "[WARNING] Program staging needs the interpreter on a scene without BVH, ignored\n";
+      }
+    }
+    if (subgroup_culling && (!evaluator.empty() || !scene.products.empty())) {
+      std::cout << "[WARNING] Subgroup culling needs the interpreter, ignored\n";
+      subgroup_culling = false;
+    } else if (subgroup_culling && !has_subgroup_features(SUBGROUP_FEATURE_VOTE)) {
+      std::cout << "[WARNING] No GL_KHR_shader_subgroup votes in compute shaders, subgroup culling disabled\n";
+      subgroup_culling = false;
+    }
+    subgroup_stats = subgroup_stats && subgroup_culling;
+    if (subgroup_stats && !has_subgroup_features(SUBGROUP_FEATURE_VOTE | SUBGROUP_FEATURE_ARITHMETIC)) {
+      std::cout << "[WARNING] No GL_KHR_shader_subgroup arithmetic in compute shaders, subgroup stats disabled\n";
+      subgroup_stats = false;
+    }
+    if (subgroup_culling) defines += "#define SUBGROUP_CULLING\n";
+    if (subgroup_stats) defines += "#define SUBGROUP_STATS\n";
+    std::cout << "[RENDERER] Evaluator: "
+              << (!scene.products.empty()             ? "sum of products"
+                  : mode == evaluator_mode::profiled ? "profiled"
+                  : tiled                            ? "tiled"
+                  : evaluator.empty()                ? "interpreted"
+                                                     : "generated")
+              << "\n";
+    // The stack is not bounds checked in the shader, so a deeper program
+    // would write past it: render only the background instead
+    if (limits.stack_overflows()) {
+      std::cerr << "[ERROR] No shader variant for a stack of " << limits.stack_depth
+                << " entries, the scene is not rendered" << std::endl;
+    } else {
+      ray_tracer = &variants.get(defines, evaluator);
+    }
+
+    // Create SSBOs for the flattened CSG tree data
+    ssbo_primitives = make_ssbo(1, scene.primitives.size() * sizeof(primitive),
+                                scene.primitives.data(), GL_STATIC_DRAW);
+    ssbo_operations = make_ssbo(2, scene.operations.size() * sizeof(operation),
+                                scene.operations.data(), GL_STATIC_DRAW);
+    ssbo_id_ops = make_ssbo(3, scene.instructions.size() * sizeof(instruction),
+                            scene.instructions.data(), GL_STATIC_DRAW);
+    ssbo_bounds = make_ssbo(5, scene.node_bounds.size() * sizeof(bounds),
+                            scene.node_bounds.data(), GL_STATIC_DRAW);
+    ssbo_bvh = make_ssbo(6, scene.bvh_nodes.size() * sizeof(bvh_node),
+                         scene.bvh_nodes.data(), GL_STATIC_DRAW);
+    ssbo_products = make_ssbo(8, scene.products.size() * sizeof(sop_product),
+                              scene.products.data(), GL_STATIC_DRAW);
+    ssbo_literals = make_ssbo(9, scene.literals.size() * sizeof(glm::uint),
+                              scene.literals.data(), GL_STATIC_DRAW);
+    if (mode == evaluator_mode::profiled) {
+      std::vector<glm::uint> zeros(2 * scene.instructions.size(), 0);
+      ssbo_profile = make_ssbo(7, zeros.size() * sizeof(glm::uint), zeros.data(), GL_DYNAMIC_READ);
+    }
+    if (subgroup_stats) {
+      glm::uint zeros[3] = {0, 0, 0};
+      ssbo_subgroup = make_ssbo(13, sizeof(zeros), zeros, GL_DYNAMIC_READ);
+    }
+    // World boxes of the primitives, and one primitive mask per workgroup
+    if (gpu_binning) {
+      std::vector<bounds> boxes;
+      for (const primitive &p : scene.primitives) {
+        boxes.push_back(to_gpu_bounds(primitive_bounds(p.type, p.transform)));
+      }
+      size_t words = (scene.primitives.size() + 31) / 32;
+      size_t groups = (size_t)group_count(width, LOCAL_SIZE_X) * group_count(height, LOCAL_SIZE_Y);
+      ssbo_primitive_bounds = make_ssbo(11, boxes.size() * sizeof(bounds), boxes.data(), GL_STATIC_DRAW);
+      ssbo_tile_masks = make_ssbo(12, groups * words * sizeof(glm::uint), nullptr, GL_DYNAMIC_COPY);
+      binning = std::make_unique<compute_shader>(binning_path);
+      std::cout << "[BINNING] " << groups << " workgroups, " << words << " mask words each\n";
+    }
+    // Tile streams and their table are uploaded by render() for each view
+    if (tiled) {
+      tiles = std::make_unique<tile_program_builder>(scene, limits);
+      ssbo_tiles = make_ssbo(10, 0, nullptr, GL_DYNAMIC_DRAW);
+      update_ssbo(ssbo_bounds, tiles->node_bounds.size() * sizeof(bounds), tiles->node_bounds.data());
+    }
+
+    // Nothing outside the primitives' boxes can be hit
+    for (const primitive &p : scene.primitives) {
+      scene_box = aabb::merge(scene_box, primitive_bounds((primitive_types)p.type, p.transform));
+    }
+
+    // Per-frame object-space camera origins, one vec4 per primitive.
+    // The ray origin is shared by every pixel, so it is transformed on the CPU
+    // once per frame instead of once per primitive per invocation.
+    local_origins.resize(scene.primitives.size());
+    ssbo_local_origins = make_ssbo(4, local_origins.size() * sizeof(glm::vec4),
+                                   nullptr, GL_DYNAMIC_DRAW);
+
+    // Create Texture for output
+    glGenTextures(1, &texture_out);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture_out);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, width, height);
+    glBindImageTexture(0, texture_out, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+  }
+
+  renderer(const renderer &) = delete;
+  renderer &operator=(const renderer &) = delete;
+
+  ~renderer() {
+    glDeleteBuffers(1, &ssbo_primitives);
+    glDeleteBuffers(1, &ssbo_operations);
+    glDeleteBuffers(1, &ssbo_id_ops);
+    glDeleteBuffers(1, &ssbo_local_origins);
+    glDeleteBuffers(1, &ssbo_bounds);
+    glDeleteBuffers(1, &ssbo_bvh);
+    glDeleteBuffers(1, &ssbo_products);
+    glDeleteBuffers(1, &ssbo_literals);
+    if (ssbo_profile) glDeleteBuffers(1, &ssbo_profile);
+    if (ssbo_subgroup) glDeleteBuffers(1, &ssbo_subgroup);
+    if (ssbo_tiles) glDeleteBuffers(1, &ssbo_tiles);
+    if (binning) {
+      glDeleteBuffers(1, &ssbo_primitive_bounds);
+      glDeleteBuffers(1, &ssbo_tile_masks);
+      glDeleteProgram(binning->id);
+    }
+    glDeleteTextures(1, &texture_out);
+  }
+
+  // Ray traces one frame into texture_out.
+  void render(const glm::vec3 &camera_pos, const glm::mat4 &view) {
+    if (!ray_tracer) {
+      if (!background_valid) glClearTexImage(texture_out, 0, GL_RGBA, GL_FLOAT, &BACKGROUND_COLOR[0]);
+      background_valid = true;
+      return;
+    }
+    glm::mat4 invView = glm::inverse(view);
+
+    // Rebin the primitives only when the view changed
+    if (binning && (!binning_valid || view != binned_view)) {
+      binning->use();
+      glUniform3fv(glGetUniformLocation(binning->id, "u_camera_pos"), 1, &camera_pos[0]);
+      glUniformMatrix4fv(glGetUniformLocation(binning->id, "u_inv_view"), 1, GL_FALSE, &invView[0][0]);
+      glUniform2i(glGetUniformLocation(binning->id, "u_dims"), width, height);
+      glDispatchCompute(group_count(width, LOCAL_SIZE_X), group_count(height, LOCAL_SIZE_Y), 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT); // masks visible to the ray tracer
+      binned_view = view;
+      binning_valid = true;
+    }
+
+    ray_tracer->use();
+
+    // Refresh the object-space camera origins only when the camera moved
+    if (!origins_valid || camera_pos != last_origin) {
+      for (size_t i = 0; i < scene.primitives.size(); ++i) {
+        local_origins[i] = scene.primitives[i].inv_transform * glm::vec4(camera_pos, 1.0f);
+      }
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_local_origins);
+      glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, local_origins.size() * sizeof(glm::vec4),
+                      local_origins.data());
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+      last_origin = camera_pos;
+      origins_valid = true;
+    }
+
+    // Rebuild the per-tile programs only when the view changed
+    if (tiles && (!tiles_valid || view != last_view)) {
+      tiles->build(view, width, height);
+      if (!tiles_valid) print_tile_stats(*tiles);
+      update_ssbo(ssbo_operations, tiles->operations.size() * sizeof(operation), tiles->operations.data());
+      update_ssbo(ssbo_id_ops, tiles->instructions.size() * sizeof(instruction), tiles->instructions.data());
+      update_ssbo(ssbo_tiles, tiles->ranges.size() * sizeof(tile_range), tiles->ranges.data());
+      last_view = view;
+      tiles_valid = true;
+    }
+    if (tiles) glUniform1ui(glGetUniformLocation(ray_tracer->id, "u_tiles_x"), tiles->tiles_x);
+
+    // Set camera uniforms
+    glUniform3fv(glGetUniformLocation(ray_tracer->id, "u_camera_pos"), 1, &camera_pos[0]);
+    glUniformMatrix4fv(glGetUniformLocation(ray_tracer->id, "u_inv_view"), 1, GL_FALSE, &invView[0][0]);
+
+    // Workgroups whose rays can reach the scene's box. Pixels left out keep
+    // the background, cleared whenever the last frame wrote outside the rect.
+    screen_rect groups = screen_projection(view, width, height, LOCAL_SIZE_X).project(scene_box);
+    if (!background_valid || !groups.contains(dispatched)) {
+      glClearTexImage(texture_out, 0, GL_RGBA, GL_FLOAT, &BACKGROUND_COLOR[0]);
+      background_valid = true;
+    }
+    dispatched = groups;
+    if (groups.empty()) return;
+
+    glUniform2i(glGetUniformLocation(ray_tracer->id, "u_pixel_offset"), groups.x0 * LOCAL_SIZE_X,
+                groups.y0 * LOCAL_SIZE_Y);
+    glDispatchCompute(groups.x1 - groups.x0 + 1, groups.y1 - groups.y0 + 1, 1);
+    glMemoryBarrier(
+        GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
+        GL_TEXTURE_UPDATE_BARRIER_BIT); // wait for compute shader to finish
+                                        // writing on the texture_out
+  }
+
+  // Reads texture_out back as RGBA floats, rows bottom to top.
+  void read_pixels(std::vector<float> &rgba) const {
+    rgba.resize((size_t)width * height * 4);
+    glBindTexture(GL_TEXTURE_2D, texture_out);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rgba.data());
+  }
+
+  // Reads the counters accumulated by a profiled renderer since it was
+  // created: executions and outcomes, two per instruction. Returns false for
+  // other evaluator modes.
+  bool read_profile(std::vector<glm::uint> &counters) const {
+    if (!ssbo_profile) return false;
+    counters.resize(2 * scene.instructions.size());
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_profile);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, counters.size() * sizeof(glm::uint), counters.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return true;
+  }
+
+  // Prints the subgroup culling counters accumulated since the renderer was
+  // created. Does nothing without subgroup_stats.
+  void print_subgroup_stats() const {
+    if (!ssbo_subgroup) return;
+    glm::uint counts[3];
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_subgroup);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    std::cout << "[SUBGROUP] " << counts[1] << " of " << counts[0] << " bound tests skipped by the whole subgroup ("
+              << (counts[0] ? 100.0 * counts[1] / counts[0] : 0.0) << "%), " << counts[2]
+              << " lanes ran a missed subtree along\n";
+  }
+
+private:
+  csg_program_view scene;
+  program_limits limits;
+  shader_variant_cache &variants;
+  compute_shader *ray_tracer = nullptr; // null if the scene cannot be rendered
+
+  unsigned int ssbo_primitives, ssbo_operations, ssbo_id_ops, ssbo_local_origins, ssbo_bounds;
+  unsigned int ssbo_bvh, ssbo_products, ssbo_literals;
+  unsigned int ssbo_profile = 0;
+  unsigned int ssbo_subgroup = 0;
+  unsigned int ssbo_tiles = 0;
+
+  std::vector<glm::vec4> local_origins;
+  glm::vec3 last_origin = glm::vec3(0.0f);
+  bool origins_valid = false;
+
+  aabb scene_box;
+  screen_rect dispatched; // workgroups written by the last frame
+  bool background_valid = false;
+
+  std::unique_ptr<tile_program_builder> tiles;
+  glm::mat4 last_view = glm::mat4(1.0f);
+  bool tiles_valid = false;
+
+  std::unique_ptr<compute_shader> binning; // prepass, null without gpu_binning
+  unsigned int ssbo_primitive_bounds = 0, ssbo_tile_masks = 0;
+  glm::mat4 binned_view = glm::mat4(1.0f);
+  bool binning_valid = false;
+
+  static unsigned int make_ssbo(GLuint binding, size_t size, const void *data, GLenum usage) {
+    unsigned int ssbo;
+    glGenBuffers(1, &ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, usage);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // Unbind
+    return ssbo;
+  }
+
+  // GL_KHR_shader_subgroup feature bits. The tokens are not in the bundled
+  // glad headers.
+  static constexpr GLint SUBGROUP_FEATURE_BASIC = 0x1, SUBGROUP_FEATURE_VOTE = 0x2,
+                         SUBGROUP_FEATURE_ARITHMETIC = 0x4;
+
+  // GL_KHR_shader_subgroup with basic operations and `features` in compute
+  // shaders.
+  static bool has_subgroup_features(GLint features) {
+    const GLenum SUBGROUP_SUPPORTED_STAGES = 0x9535, SUBGROUP_SUPPORTED_FEATURES = 0x9536;
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    bool found = false;
+    for (GLint i = 0; i < count && !found; ++i) {
+      found = std::string((const char *)glGetStringi(GL_EXTENSIONS, i)) == "GL_KHR_shader_subgroup";
+    }
+    if (!found) return false;
+    GLint stages = 0, supported = 0;
+    glGetIntegerv(SUBGROUP_SUPPORTED_STAGES, &stages);
+    glGetIntegerv(SUBGROUP_SUPPORTED_FEATURES, &supported);
+    const GLint needed = SUBGROUP_FEATURE_BASIC | features;
+    return (stages & GL_COMPUTE_SHADER_BIT) && (supported & needed) == needed;
+  }
+
+  // Workgroups covering `pixels`, the last one partly outside the image
+  static int group_count(int pixels, int local_size) { return (pixels + local_size - 1) / local_size; }
+
+  // Replaces the contents of a buffer made by make_ssbo(), which may change size
+  static void update_ssbo(unsigned int ssbo, size_t size, const void *data) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+};
+
+#endif // RENDERER_H
@@ -0,0 +1,313 @@
+#ifndef SCENE_BINARY_H
+#define SCENE_BINARY_H
+
+#include "csgrn/csg_parser.hpp"
+#include "csgrn/csg_program.hpp"
+#include "csgrn/csg_simplify.hpp"
+#include "csgrn/csg_sop.hpp"
+#include "csgrn/glsl_codegen.hpp"
+#include "csgrn/mapped_file.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// .csgb: a compiled scene. The flattened arrays are stored verbatim, each in
+// its own aligned section, so a mapped file can be handed to glBufferData
+// without any parsing.
+//
+//   csgb_header | csgb_section[section_count] | padding | section data ...
+
+constexpr char CSGB_MAGIC[4] = {'C', 'S', 'G', 'B'};
+constexpr uint32_t CSGB_VERSION = 7; // 7: operation::count (k-way operations)
+constexpr uint64_t CSGB_ALIGNMENT = 64;
+
+enum class csgb_section_id : uint32_t {
+  primitives = 1,
+  operations = 2,
+  instructions = 3,
+  node_bounds = 4,
+  bvh_nodes = 5,
+  products = 6,
+  literals = 7
+};
+
+struct csgb_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t section_count;
+  uint32_t reserved;
+};
+
+struct csgb_section {
+  uint32_t id;
+  uint32_t stride; // sizeof one element, checked against the loader's layout
+  uint64_t offset; // from the start of the file, CSGB_ALIGNMENT aligned
+  uint64_t count;
+};
+
+inline uint64_t csgb_align(uint64_t value) {
+  return (value + CSGB_ALIGNMENT - 1) & ~(CSGB_ALIGNMENT - 1);
+}
+
+class csgb_writer {
+  struct pending_section {
+    csgb_section header;
+    const void *data;
+  };
+  std::vector<pending_section> sections;
+
+public:
+  // T must have no implicit padding, so the output does not depend on
+  // uninitialized bytes: spell it out as zero-initialized members instead.
+  template <typename T>
+  void add(csgb_section_id id, std::span<const T> data) {
+    csgb_section s{};
+    s.id = (uint32_t)id;
+    s.stride = sizeof(T);
+    s.count = data.size();
+    sections.push_back({s, data.data()});
+  }
+
+  bool write(const std::string &path) {
+    uint64_t offset = csgb_align(sizeof(csgb_header) +
+                                 sections.size() * sizeof(csgb_section));
+    for (auto &s : sections) {
+      s.header.offset = offset;
+      offset = csgb_align(offset + s.header.stride * s.header.count);
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      std::cerr << "Error: Could not open " << path << " for writing" << std::endl;
+      return false;
+    }
+
+    csgb_header header{};
+    std::memcpy(header.magic, CSGB_MAGIC, sizeof(CSGB_MAGIC));
+    header.version = CSGB_VERSION;
+    header.section_count = sections.size();
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto &s : sections) {
+      out.write(reinterpret_cast<const char *>(&s.header), sizeof(csgb_section));
+    }
+
+    static const char zeros[CSGB_ALIGNMENT] = {};
+    for (const auto &s : sections) {
+      uint64_t pos = out.tellp();
+      out.write(zeros, s.header.offset - pos);
+      out.write(static_cast<const char *>(s.data), s.header.stride * s.header.count);
+    }
+    uint64_t pos = out.tellp();
+    out.write(zeros, csgb_align(pos) - pos);
+
+    if (!out.good()) {
+      std::cerr << "Error: Failed writing " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+inline bool write_csgb(const std::string &path, const csg_program_view &program) {
+  csgb_writer writer;
+  writer.add(csgb_section_id::primitives, program.primitives);
+  writer.add(csgb_section_id::operations, program.operations);
+  writer.add(csgb_section_id::instructions, program.instructions);
+  writer.add(csgb_section_id::node_bounds, program.node_bounds);
+  writer.add(csgb_section_id::bvh_nodes, program.bvh_nodes);
+  writer.add(csgb_section_id::products, program.products);
+  writer.add(csgb_section_id::literals, program.literals);
+  return writer.write(path);
+}
+
+// A mapped .csgb file. `program` points straight into the mapping and stays
+// valid for the lifetime of this object.
+class csgb_scene {
+public:
+  csg_program_view program;
+
+  bool load(const std::string &path) {
+    program = csg_program_view();
+    if (!file.open(path)) return false;
+
+    if (file.size() < sizeof(csgb_header)) {
+      std::cerr << "[ERROR] " << path << " is too small to be a .csgb file" << std::endl;
+      return false;
+    }
+    const csgb_header *header = reinterpret_cast<const csgb_header *>(file.data());
+    if (std::memcmp(header->magic, CSGB_MAGIC, sizeof(CSGB_MAGIC)) != 0) {
+      std::cerr << "[ERROR] " << path << " is not a .csgb file" << std::endl;
+      return false;
+    }
+    if (header->version != CSGB_VERSION) {
+      std::cerr << "[ERROR] " << path << " has version " << header->version
+                << ", expected " << CSGB_VERSION << ". Recompile it." << std::endl;
+      return false;
+    }
+    if (sizeof(csgb_header) + header->section_count * sizeof(csgb_section) > file.size()) {
+      std::cerr << "[ERROR] " << path << " has a truncated section table" << std::endl;
+      return false;
+    }
+
+    const csgb_section *sections =
+        reinterpret_cast<const csgb_section *>(file.data() + sizeof(csgb_header));
+    bool ok = true;
+    for (uint32_t i = 0; i < header->section_count; ++i) {
+      const csgb_section &s = sections[i];
+      switch ((csgb_section_id)s.id) {
+      case csgb_section_id::primitives:
+        ok &= bind(path, s, program.primitives);
+        break;
+      case csgb_section_id::operations:
+        ok &= bind(path, s, program.operations);
+        break;
+      case csgb_section_id::instructions:
+        ok &= bind(path, s, program.instructions);
+        break;
+      case csgb_section_id::node_bounds:
+        ok &= bind(path, s, program.node_bounds);
+        break;
+      case csgb_section_id::bvh_nodes:
+        ok &= bind(path, s, program.bvh_nodes);
+        break;
+      case csgb_section_id::products:
+        ok &= bind(path, s, program.products);
+        break;
+      case csgb_section_id::literals:
+        ok &= bind(path, s, program.literals);
+        break;
+      default:
+        break; // unknown sections are skipped
+      }
+    }
+    return ok;
+  }
+
+private:
+  mapped_file file;
+
+  template <typename T>
+  bool bind(const std::string &path, const csgb_section &s, std::span<const T> &out) {
+    if (s.stride != sizeof(T)) {
+      std::cerr << "[ERROR] " << path << ": section " << s.id << " has stride "
+                << s.stride << ", expected " << sizeof(T) << std::endl;
+      return false;
+    }
+    if (s.offset % CSGB_ALIGNMENT != 0 || s.offset > file.size() ||
+        s.count > (file.size() - s.offset) / sizeof(T)) {
+      std::cerr << "[ERROR] " << path << ": section " << s.id << " is out of bounds" << std::endl;
+      return false;
+    }
+    out = std::span<const T>(reinterpret_cast<const T *>(file.data() + s.offset), s.count);
+    return true;
+  }
+};
+
+// Parses and simplifies a .csg file into `tree`.
+inline bool load_csg_tree(const std::string &path, csg_tree &tree) {
+  mapped_file file(path);
+  if (file.empty()) return false;
+
+  csg_parser parser(file.view());
+  tree = parser.parse();
+  if (tree.empty()) {
+    std::cerr << "[ERROR] CSG parsing failed for " << path << std::endl;
+    return false;
+  }
+
+  csg_simplifier simplifier;
+  tree = simplifier.simplify(tree);
+  print_simplify_stats(simplifier.last);
+  return true;
+}
+
+// Flattens `tree` into `program`. k-way operations are kept only while the
+// program has at most `k_way_max_instructions` instructions; a longer one is
+// flattened again with binary operations, for the interpreter (see
+// csg_tree::flatten_tree()).
+inline void flatten_program(csg_tree &tree, csg_program &program, size_t k_way_max_instructions) {
+  program.clear();
+  bool k_way = k_way_max_instructions > 0;
+  tree.flatten_tree(program, k_way);
+  if (k_way && program.instructions.size() > k_way_max_instructions) {
+    program.clear();
+    tree.flatten_tree(program, false);
+  }
+}
+
+// Parses and flattens a .csg file into `program`, see flatten_program().
+// With `sum_of_products` the scene is compiled to products instead, if it
+// fits (see csg_sop.hpp).
+inline bool load_csg(const std::string &path, csg_program &program, bool sum_of_products = false,
+                     size_t k_way_max_instructions = SIZE_MAX) {
+  csg_tree tree;
+  if (!load_csg_tree(path, tree)) return false;
+  program.clear();
+  if (sum_of_products) {
+    sop_normalizer normalizer;
+    if (normalizer.flatten(tree, program)) return true;
+    std::cout << "[SOP] " << normalizer.failure << ", using interval lists\n";
+  }
+  flatten_program(tree, program, k_way_max_instructions);
+  return true;
+}
+
+// Compiles with the k-way limit of the automatic evaluator, so the .csgb
+// holds the program it would build from the .csg.
+inline bool compile_csg(const std::string &in_path, const std::string &out_path,
+                        bool sum_of_products = false) {
+  csg_program program;
+  if (!load_csg(in_path, program, sum_of_products, CODEGEN_MAX_INSTRUCTIONS)) return false;
+  return write_csgb(out_path, program);
+}
+
+// Compiles every .csg file in `dir` into a .csgb next to it, on `threads`
+// workers. Returns the number of files that failed.
+inline size_t compile_csg_directory(const std::string &dir, unsigned threads = 0) {
+  std::vector<std::filesystem::path> inputs;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".csg") {
+      inputs.push_back(entry.path());
+    }
+  }
+  if (ec) {
+    std::cerr << "Error: Could not read directory " << dir << ": " << ec.message() << std::endl;
+    return 1;
+  }
+
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min<unsigned>(threads, std::max<size_t>(inputs.size(), 1));
+
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> failed{0};
+  std::mutex log_mutex;
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < inputs.size(); i = next++) {
+      std::filesystem::path out = inputs[i];
+      out.replace_extension(".csgb");
+      bool ok = compile_csg(inputs[i].string(), out.string());
+      if (!ok) failed++;
+      std::lock_guard<std::mutex> lock(log_mutex);
+      std::cout << (ok ? "[OK]   " : "[FAIL] ") << inputs[i].string() << " -> "
+                << out.string() << std::endl;
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < threads; ++t) pool.emplace_back(worker);
+  for (auto &t : pool) t.join();
+
+  return failed;
+}
+
+#endif // SCENE_BINARY_H
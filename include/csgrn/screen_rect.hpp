@@ -0,0 +1,73 @@
+#ifndef SCREEN_RECT_H
+#define SCREEN_RECT_H
+
+#include "csgrn/bounds.hpp"
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <limits>
+
+// Cells of a screen grid covered by a projected box, inclusive. Empty when
+// x0 > x1.
+struct screen_rect {
+  int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+
+  bool empty() const { return x0 > x1 || y0 > y1; }
+  bool contains(int x, int y) const { return x >= x0 && x <= x1 && y >= y0 && y <= y1; }
+  bool contains(const screen_rect &r) const {
+    return r.empty() || (!empty() && r.x0 >= x0 && r.x1 <= x1 && r.y0 >= y0 && r.y1 <= y1);
+  }
+};
+
+// The camera projection of raytracer.glsl's main(): pixel p gets the ray
+// through view-space point ((2 p / dims - 1) * (aspect, 1), -1). The image
+// is split into square cells of `cell` pixels, the last ones clipped.
+struct screen_projection {
+  glm::mat4 view;
+  glm::vec2 dims;
+  float aspect;
+  int cell;
+  int cells_x, cells_y;
+
+  screen_projection(const glm::mat4 &view, int width, int height, int cell)
+      : view(view), dims(width, height), aspect((float)width / (float)height), cell(cell),
+        cells_x((width + cell - 1) / cell), cells_y((height + cell - 1) / cell) {}
+
+  // Cells whose rays can hit something inside `box`
+  screen_rect project(const aabb &box) const {
+    screen_rect rect;
+    if (box.empty()) return rect;
+
+    glm::vec2 lo(std::numeric_limits<float>::infinity());
+    glm::vec2 hi(-std::numeric_limits<float>::infinity());
+    int behind = 0;
+    for (int i = 0; i < 8; ++i) {
+      glm::vec3 corner((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y,
+                       (i & 4) ? box.max.z : box.min.z);
+      glm::vec4 q = view * glm::vec4(corner, 1.0f);
+      if (q.z >= 0.0f) {
+        behind++;
+        continue;
+      }
+      glm::vec2 uv = glm::vec2(q) / -q.z;
+      uv.x /= aspect;
+      glm::vec2 pixel = (uv + 1.0f) * 0.5f * dims;
+      lo = glm::min(lo, pixel);
+      hi = glm::max(hi, pixel);
+    }
+    if (behind == 8) return rect; // rays only go forward
+    if (behind > 0) return {0, 0, cells_x - 1, cells_y - 1};
+
+    // One pixel of slack for rounding, clamped before converting to int
+    glm::vec2 c0 = glm::clamp(glm::floor((lo - 1.0f) / (float)cell), glm::vec2(-1.0f),
+                              glm::vec2(cells_x, cells_y));
+    glm::vec2 c1 = glm::clamp(glm::floor((hi + 1.0f) / (float)cell), glm::vec2(-1.0f),
+                              glm::vec2(cells_x, cells_y));
+    rect.x0 = std::max((int)c0.x, 0);
+    rect.y0 = std::max((int)c0.y, 0);
+    rect.x1 = std::min((int)c1.x, cells_x - 1);
+    rect.y1 = std::min((int)c1.y, cells_y - 1);
+    return rect;
+  }
+};
+
+#endif // SCREEN_RECT_H
@@ -0,0 +1,26 @@
+#ifndef SOP_PRODUCT_H
+#define SOP_PRODUCT_H
+
+#include <glm/glm.hpp>
+
+// Sum-of-products program (see csg_sop.hpp): the scene is the union of its
+// products, each the intersection of its literals. A literal is a primitive
+// index shifted left by one, with the low bit set when it is negated.
+
+// Literals per product, bounds the fixed-size array in raytracer.glsl
+constexpr glm::uint SOP_LITERALS_LIMIT = 16;
+
+// GPU layout (std140: two vec4). `min`/`max` bound the product (the overlap of
+// its positive literals); it covers literals[first, first + count).
+struct alignas(16) sop_product {
+  glm::vec3 min;
+  glm::uint first;
+  glm::vec3 max;
+  glm::uint count;
+};
+
+inline glm::uint sop_literal(glm::uint primitive, bool negated) { return primitive << 1 | (negated ? 1u : 0u); }
+inline glm::uint sop_literal_primitive(glm::uint literal) { return literal >> 1; }
+inline bool sop_literal_negated(glm::uint literal) { return (literal & 1u) != 0; }
+
+#endif // SOP_PRODUCT_H
@@ -0,0 +1,185 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include "csgrn/operations.hpp"
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+
+// Packed span, the C++ side of `span` in raytracer.glsl: entry and exit
+// distances along the ray, and the primitive whose surface starts the span,
+// shifted left by one, with the low bit set when its normal must be flipped
+// (the surface is seen from inside a subtrahend).
+struct packed_span {
+  glm::vec2 interval;
+  glm::uint id;
+};
+
+inline glm::uint pack_span_id(glm::uint primitive, bool inverted) { return primitive << 1 | (inverted ? 1u : 0u); }
+inline glm::uint span_primitive(glm::uint id) { return id >> 1; }
+inline bool span_inverted(glm::uint id) { return (id & 1u) != 0; }
+
+// Flat pool of interval lists, as in the shader: list L owns the spans
+// [L * max_spans, (L + 1) * max_spans). Operations write their result into
+// another list of the pool instead of returning a copy.
+class span_pool {
+public:
+  static constexpr float INF = std::numeric_limits<float>::infinity();
+
+  span_pool(glm::uint lists, glm::uint max_spans)
+      : max_spans(max_spans), spans((size_t)lists * max_spans), counts(lists, 0) {}
+
+  int count(int list) const { return counts[list]; }
+  const packed_span &at(int list, int k) const { return spans[(size_t)list * max_spans + k]; }
+  void clear(int list) { counts[list] = 0; }
+
+  // One span for a primitive hit, none on a miss
+  void set_primitive(int list, glm::vec2 hit, glm::uint primitive) {
+    if (hit.x >= hit.y) {
+      counts[list] = 0; // Miss
+    } else {
+      counts[list] = 1;
+      spans[(size_t)list * max_spans] = {hit, pack_span_id(primitive, false)};
+    }
+  }
+
+  void copy(int dst, int src) {
+    for (int k = 0; k < counts[src]; ++k) spans[(size_t)dst * max_spans + k] = at(src, k);
+    counts[dst] = counts[src];
+  }
+
+  // First span the shading would pick, if any
+  bool first_visible(int list, packed_span &hit) const {
+    for (int k = 0; k < counts[list]; k++) {
+      if (at(list, k).interval.x > 0.001f) {
+        hit = at(list, k);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  float first_visible_entry(int list) const {
+    packed_span hit;
+    return first_visible(list, hit) ? hit.interval.x : INF;
+  }
+
+  // Boolean `op` of lists a and b into list dst, which must be neither.
+  // Matches merge_into() in raytracer.glsl.
+  void merge(int dst, int a, int b, glm::uint op) {
+    int count_a = counts[a];
+    int count_b = counts[b];
+    packed_span *out = &spans[(size_t)dst * max_spans];
+    int n = 0;
+
+    int i = 0;
+    int j = 0;
+    bool in_a = false, in_b = false;
+    bool last_in_result = false;
+    float t_start = 0.0f;
+    glm::uint start_id = 0;
+    // Leaving the subtrahend shows its surface from the inside
+    glm::uint b_flip = op == (glm::uint)op_types::op_difference ? 1u : 0u;
+
+    while ((i < count_a || j < count_b) && n < (int)max_spans) {
+      float t_a = INF;
+      float t_b = INF;
+      if (i < count_a) t_a = in_a ? at(a, i).interval.y : at(a, i).interval.x;
+      if (j < count_b) t_b = in_b ? at(b, j).interval.y : at(b, j).interval.x;
+
+      // Pick the closest point
+      float current_t;
+      glm::uint current_id;
+      if (t_a < t_b) {
+        current_t = t_a;
+        current_id = at(a, i).id;
+        in_a = !in_a;
+        if (!in_a) i++;
+      } else {
+        current_t = t_b;
+        current_id = at(b, j).id ^ b_flip;
+        in_b = !in_b;
+        if (!in_b) j++;
+      }
+
+      bool in_result = is_inside(op, in_a, in_b);
+      if (in_result != last_in_result) {
+        if (in_result) {
+          t_start = current_t;
+          start_id = current_id;
+        } else if (current_t > t_start + 0.0001f) {
+          out[n++] = {glm::vec2(t_start, current_t), start_id};
+        }
+        last_in_result = in_result;
+      }
+    }
+    counts[dst] = n;
+  }
+
+  // Union or intersection of `k` lists into list dst in one sweep, counting
+  // how many operands the ray is inside. Matches merge_many() in
+  // raytracer.glsl.
+  void merge_many(int dst, const int *lists, int k, glm::uint op) {
+    int next[MAX_OPERANDS] = {}; // current span of each operand
+    bool inside[MAX_OPERANDS] = {};
+    int covered = 0;
+    int needed = op == (glm::uint)op_types::op_intersection ? k : 1;
+    packed_span *out = &spans[(size_t)dst * max_spans];
+    int n = 0;
+
+    bool last_in_result = false;
+    float t_start = 0.0f;
+    glm::uint start_id = 0;
+
+    while (n < (int)max_spans) {
+      // Pick the closest point over all operands
+      int pick = -1;
+      float current_t = INF;
+      for (int j = 0; j < k; ++j) {
+        if (next[j] >= counts[lists[j]]) continue;
+        const packed_span &s = at(lists[j], next[j]);
+        float t = inside[j] ? s.interval.y : s.interval.x;
+        if (pick < 0 || t < current_t) {
+          pick = j;
+          current_t = t;
+        }
+      }
+      if (pick < 0) break;
+
+      glm::uint current_id = at(lists[pick], next[pick]).id;
+      inside[pick] = !inside[pick];
+      if (inside[pick]) {
+        covered++;
+      } else {
+        covered--;
+        next[pick]++;
+      }
+
+      bool in_result = covered >= needed;
+      if (in_result != last_in_result) {
+        if (in_result) {
+          t_start = current_t;
+          start_id = current_id;
+        } else if (current_t > t_start + 0.0001f) {
+          out[n++] = {glm::vec2(t_start, current_t), start_id};
+        }
+        last_in_result = in_result;
+      }
+    }
+    counts[dst] = n;
+  }
+
+private:
+  glm::uint max_spans;
+  std::vector<packed_span> spans;
+  std::vector<int> counts;
+
+  static bool is_inside(glm::uint op, bool in_a, bool in_b) {
+    if (op == (glm::uint)op_types::op_union) return in_a || in_b;
+    if (op == (glm::uint)op_types::op_intersection) return in_a && in_b;
+    if (op == (glm::uint)op_types::op_difference) return in_a && !in_b;
+    return false;
+  }
+};
+
+#endif // SPAN_H
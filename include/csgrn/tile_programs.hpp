@@ -0,0 +1,400 @@
+#ifndef TILE_PROGRAMS_H
+#define TILE_PROGRAMS_H
+
+#include "csgrn/csg_program.hpp"
+#include "csgrn/program_limits.hpp"
+#include "csgrn/screen_rect.hpp"
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+// Per-screen-tile programs. Whenever the camera moves, the boxes of the
+// primitives and of the BOUNDS subtrees are projected to screen space, and
+// for every TILE_PROGRAM_SIZE square tile the instruction stream is emitted
+// again without what misses the tile, folding the Boolean identities
+//
+//   A + 0 = A      A * 0 = 0      A - 0 = A      0 - A = 0
+//
+// Only primary rays are traced, so the rays of a tile can only hit geometry
+// whose projection touches it. The tile streams follow the scene's own
+// instructions, and tile_ranges tells the shader which one each tile runs
+// (see evaluate_scene() in raytracer.glsl).
+//
+// LOADs are replaced by the stored subtree. The BVH leaves touching a tile
+// are unioned nearest first, each behind a SKIP_IF_BEYOND on its box, so the
+// stream stops early like the traversal does. A tile whose stream would
+// outgrow the compiled shader limits or the whole program, or that touches
+// more than TILE_MAX_BVH_LEAVES leaves, runs the whole program instead.
+constexpr int TILE_PROGRAM_SIZE = 32; // pixels, a multiple of the workgroup size
+constexpr size_t TILE_MAX_BVH_LEAVES = 4;
+constexpr glm::uint TILE_FULL_PROGRAM = 0xFFFFFFFFu; // tile_range::first
+
+// GPU layout (std430 uvec2): the tile runs instructions[first, end). An empty
+// range is background only. first == TILE_FULL_PROGRAM runs the whole scene,
+// end is then its number of instructions.
+struct tile_range {
+  glm::uint first;
+  glm::uint end;
+};
+
+class tile_program_builder {
+public:
+  struct stats {
+    size_t pruned = 0;       // tiles running their own stream
+    size_t empty = 0;        // tiles where nothing can be hit
+    size_t full = 0;         // tiles running the whole program
+    size_t instructions = 0; // in the tile streams
+  };
+
+  std::vector<instruction> instructions; // the scene's, then the tile streams
+  std::vector<operation> operations;     // the scene's, then the ones added for tiles
+  std::vector<bounds> node_bounds;       // the scene's, one per BVH node, then an empty box
+  std::vector<tile_range> ranges;        // row-major, tile (0, 0) holds pixel (0, 0)
+  int tiles_x = 0;
+  int tiles_y = 0;
+  stats last;
+
+  tile_program_builder(const csg_program_view &program, const program_limits &limits)
+      : src(program), limits(limits) {
+    for (const primitive &p : program.primitives) {
+      primitive_boxes.push_back(primitive_bounds((primitive_types)p.type, p.transform));
+    }
+    node_bounds.assign(program.node_bounds.begin(), program.node_bounds.end());
+    for (const bvh_node &node : program.bvh_nodes) node_bounds.push_back(to_gpu_bounds({node.min, node.max}));
+    node_bounds.push_back(to_gpu_bounds(aabb()));
+  }
+
+  // Rebuilds the tile streams for a camera `view` and a width x height image
+  void build(const glm::mat4 &view, int width, int height) {
+    tiles_x = (width + TILE_PROGRAM_SIZE - 1) / TILE_PROGRAM_SIZE;
+    tiles_y = (height + TILE_PROGRAM_SIZE - 1) / TILE_PROGRAM_SIZE;
+    instructions.assign(src.instructions.begin(), src.instructions.end());
+    operations.assign(src.operations.begin(), src.operations.end());
+    union_ops.assign(MAX_OPERANDS + 1, TILE_FULL_PROGRAM);
+    ranges.clear();
+    last = stats();
+
+    // Screen rectangles of every box the streams test
+    screen_projection s(view, width, height, TILE_PROGRAM_SIZE);
+    primitive_rects.clear();
+    for (const aabb &box : primitive_boxes) primitive_rects.push_back(s.project(box));
+    bounds_rects.clear();
+    for (const bounds &b : src.node_bounds) {
+      bounds_rects.push_back(b.min.w != 0.0f ? screen_rect() : s.project({glm::vec3(b.min), glm::vec3(b.max)}));
+    }
+    leaf_rects.clear();
+    for (const bvh_node &node : src.bvh_nodes) {
+      leaf_rects.push_back(node.count == 0 ? screen_rect() : s.project({node.min, node.max}));
+    }
+
+    // Leaves nearest to the camera first
+    glm::vec3 eye = glm::vec3(glm::inverse(view)[3]);
+    leaf_order.clear();
+    for (size_t n = 0; n < src.bvh_nodes.size(); ++n) {
+      const bvh_node &node = src.bvh_nodes[n];
+      if (node.count == 0) continue;
+      glm::vec3 gap = glm::max(glm::max(node.min - eye, eye - node.max), glm::vec3(0.0f));
+      leaf_order.push_back({glm::dot(gap, gap), n});
+    }
+    std::sort(leaf_order.begin(), leaf_order.end());
+
+    for (int ty = 0; ty < tiles_y; ++ty) {
+      for (int tx = 0; tx < tiles_x; ++tx) {
+        tile_range range = build_tile(tx, ty);
+        if (range.first == TILE_FULL_PROGRAM) {
+          last.full++;
+        } else if (range.first == range.end) {
+          last.empty++;
+        } else {
+          last.pruned++;
+        }
+        ranges.push_back(range);
+      }
+    }
+    last.instructions = instructions.size() - src.instructions.size();
+  }
+
+private:
+  // Pruning stack entry: a fragment of `code`, or a gate instruction waiting
+  // for the operation after the operand it precedes
+  struct entry {
+    bool gate = false;
+    bool empty = false;
+    size_t begin = 0, end = 0; // fragment code
+    instruction inst{};        // gate
+  };
+
+  struct guard {
+    size_t last;       // last instruction of the subtree
+    size_t stack_size; // stack size before it
+    glm::uint bounds;
+  };
+
+  struct slot {
+    bool empty = true;
+    std::vector<instruction> code;
+  };
+
+  csg_program_view src;
+  program_limits limits;
+  std::vector<aabb> primitive_boxes;
+  std::vector<screen_rect> primitive_rects, bounds_rects, leaf_rects;
+  std::vector<glm::uint> union_ops; // operation added for a union of `count` operands
+  std::vector<std::pair<float, size_t>> leaf_order; // squared distance, BVH node
+
+  // Scratch state of the tile being built
+  std::vector<instruction> code, moved;
+  std::vector<entry> stack, parts;
+  std::vector<guard> guards;
+  std::vector<slot> slots;
+
+  tile_range build_tile(int tx, int ty) {
+    const tile_range full{TILE_FULL_PROGRAM, (glm::uint)src.instructions.size()};
+    code.clear();
+    if (src.bvh_nodes.empty()) {
+      int result = prune_range(0, src.instructions.size(), tx, ty);
+      if (result < 0) return full;
+    } else {
+      // As in the traversal: the leaves touching the tile are unioned into
+      // an empty accumulator, nearest first, each skipped when the ray
+      // misses its box or the box starts past the closest hit so far. The
+      // box that always misses pushes the empty list.
+      code.push_back({(glm::uint)node_type::BOUNDS, (glm::uint)(node_bounds.size() - 1), 0});
+      size_t leaves = 0;
+      for (const auto &[distance, n] : leaf_order) {
+        const bvh_node &node = src.bvh_nodes[n];
+        if (!leaf_rects[n].contains(tx, ty)) continue;
+        if (++leaves > TILE_MAX_BVH_LEAVES) return full;
+        glm::uint box = (glm::uint)(src.node_bounds.size() + n);
+        size_t gate = code.size();
+        code.push_back({(glm::uint)node_type::SKIP_IF_BEYOND, box});
+        code.push_back({(glm::uint)node_type::BOUNDS, box});
+        int result = prune_range(node.first, node.first + node.count, tx, ty);
+        if (result < 0) return full;
+        if (result == 0) {
+          code.resize(gate);
+          continue;
+        }
+        code[gate + 1].skip = (glm::uint)(code.size() - gate - 2);
+        code.push_back({(glm::uint)node_type::OPERATION, union_operation(2)});
+        code[gate].skip = (glm::uint)(code.size() - gate - 1);
+      }
+      if (code.size() == 1) code.clear();
+    }
+    if (code.empty()) return {0, 0};
+
+    // Must fit the shader compiled for the whole scene, and not be longer.
+    // Pruning never adds spans to a leaf, and the union of the leaves
+    // truncates like the accumulator of the BVH traversal does.
+    csg_program_view view;
+    view.instructions = code;
+    view.operations = operations;
+    program_limits needs = compute_program_limits(view);
+    if (!needs.valid || needs.stack_depth > limits.stack_depth ||
+        (src.bvh_nodes.empty() && needs.required_spans > limits.max_spans) ||
+        code.size() >= src.instructions.size()) {
+      return full;
+    }
+
+    // Neighbouring tiles often end up with the same stream
+    if (!ranges.empty()) {
+      const tile_range &prev = ranges.back();
+      if (prev.first != TILE_FULL_PROGRAM && prev.end - prev.first == code.size() &&
+          std::equal(code.begin(), code.end(), instructions.begin() + prev.first, same_instruction)) {
+        return prev;
+      }
+    }
+    tile_range range{(glm::uint)instructions.size(), (glm::uint)(instructions.size() + code.size())};
+    instructions.insert(instructions.end(), code.begin(), code.end());
+    return range;
+  }
+
+  static bool same_instruction(const instruction &a, const instruction &b) {
+    return a.type == b.type && a.id == b.id && a.skip == b.skip;
+  }
+
+  glm::uint union_operation(glm::uint count) {
+    if (union_ops[count] == TILE_FULL_PROGRAM) {
+      union_ops[count] = operations.size();
+      operations.push_back({(glm::uint)op_types::op_union, 0, 0, count});
+    }
+    return union_ops[count];
+  }
+
+  // Appends the pruned instructions[first, end) for tile (tx, ty) to `code`.
+  // Returns 1 if it left code, 0 if the range is empty for the tile and -1
+  // if the stream is malformed.
+  int prune_range(size_t first, size_t end, int tx, int ty) {
+    stack.clear();
+    guards.clear();
+    slots.clear();
+    for (size_t i = first; i < end; ++i) {
+      const instruction &inst = src.instructions[i];
+      if (inst.type == (glm::uint)node_type::PRIMITIVE) {
+        if (inst.id >= primitive_rects.size()) return -1;
+        bool hit = primitive_rects[inst.id].contains(tx, ty);
+        if (hit) code.push_back(inst);
+        push_fragment(code.size() - (hit ? 1 : 0), !hit);
+      } else if (inst.type == (glm::uint)node_type::OPERATION) {
+        if (inst.id >= src.operations.size() || !apply_operation(inst)) return -1;
+      } else if (inst.type == (glm::uint)node_type::BOUNDS) {
+        if (inst.id >= bounds_rects.size()) return -1;
+        if (!bounds_rects[inst.id].contains(tx, ty)) {
+          push_fragment(code.size(), true);
+          i += inst.skip;
+        } else if (inst.skip > 0) {
+          guards.push_back({i + inst.skip, stack.size(), inst.id});
+        }
+      } else if (inst.type == (glm::uint)node_type::STORE) {
+        if (stack.empty() || stack.back().gate) return -1;
+        if (slots.size() <= inst.id) slots.resize(inst.id + 1);
+        const entry &top = stack.back();
+        slots[inst.id].empty = top.empty;
+        slots[inst.id].code.assign(code.begin() + top.begin, code.begin() + top.end);
+      } else if (inst.type == (glm::uint)node_type::LOAD) {
+        if (inst.id >= slots.size()) return -1;
+        size_t begin = code.size();
+        code.insert(code.end(), slots[inst.id].code.begin(), slots[inst.id].code.end());
+        push_fragment(begin, slots[inst.id].empty);
+      } else {
+        entry gate;
+        gate.gate = true;
+        gate.inst = inst;
+        stack.push_back(gate);
+      }
+
+      // Put the box test back around subtrees that survived
+      while (!guards.empty() && guards.back().last <= i) {
+        guard g = guards.back();
+        guards.pop_back();
+        if (stack.size() != g.stack_size + 1 || stack.back().gate) continue;
+        entry &top = stack.back();
+        if (top.empty || top.end - top.begin < 2) continue;
+        code.insert(code.begin() + top.begin,
+                    {(glm::uint)node_type::BOUNDS, g.bounds, (glm::uint)(top.end - top.begin)});
+        top.end++;
+      }
+    }
+    if (stack.size() != 1 || stack.back().gate) return -1;
+    return stack.back().empty ? 0 : 1;
+  }
+
+  void push_fragment(size_t begin, bool empty) {
+    entry e;
+    e.empty = empty;
+    e.begin = begin;
+    e.end = code.size();
+    stack.push_back(e);
+  }
+
+  bool apply_operation(const instruction &inst) {
+    const operation &op = src.operations[inst.id];
+
+    // The operands, bottom first, with the gates between them
+    size_t found = 0;
+    size_t index = stack.size();
+    while (found < op.count && index > 0) {
+      if (!stack[--index].gate) found++;
+    }
+    if (found < op.count) return false;
+    parts.assign(stack.begin() + index, stack.end());
+    stack.resize(index);
+    size_t base = parts.front().begin;
+
+    // Operands that still count: all, or the non-empty ones of a union
+    bool any_empty = false;
+    size_t kept = 0;
+    for (entry &e : parts) {
+      if (e.gate) continue;
+      any_empty |= e.empty;
+      if (!e.empty) kept++;
+    }
+    entry *first = nullptr, *second = nullptr; // of a binary operation
+    for (entry &e : parts) {
+      if (e.gate) continue;
+      (first ? second : first) = &e;
+      if (second) break;
+    }
+    bool empty = false;
+    entry *only = nullptr; // the single operand the result reduces to
+    switch ((op_types)op.type) {
+    case op_types::op_union:
+      empty = kept == 0;
+      if (kept == 1) {
+        for (entry &e : parts) {
+          if (!e.gate && !e.empty) only = &e;
+        }
+      }
+      break;
+    case op_types::op_intersection:
+      empty = any_empty;
+      break;
+    case op_types::op_difference:
+      empty = first->empty;
+      if (!empty && second->empty) only = first;
+      break;
+    case op_types::op_reverse_difference:
+      empty = second->empty;
+      if (!empty && first->empty) only = second;
+      break;
+    default:
+      return false;
+    }
+
+    if (empty) {
+      code.resize(base);
+      push_fragment(base, true);
+      return true;
+    }
+    if (only) {
+      std::copy(code.begin() + only->begin, code.begin() + only->end, code.begin() + base);
+      code.resize(base + (only->end - only->begin));
+      push_fragment(base, false);
+      return true;
+    }
+
+    // Emit the surviving operands again, with their gates
+    moved.assign(code.begin() + base, code.end());
+    code.resize(base);
+    size_t gates_begin = stack.size(); // gate positions, parked on the stack
+    const instruction *gate = nullptr;
+    bool emitted = false;
+    for (const entry &e : parts) {
+      if (e.gate) {
+        gate = &e.inst;
+        continue;
+      }
+      if (!e.empty) {
+        if (gate && emitted) {
+          entry g;
+          g.gate = true;
+          g.begin = code.size();
+          stack.push_back(g);
+          code.push_back(*gate);
+        }
+        code.insert(code.end(), moved.begin() + (e.begin - base), moved.begin() + (e.end - base));
+        emitted = true;
+      }
+      gate = nullptr;
+    }
+    glm::uint op_id = kept == op.count ? inst.id : union_operation(kept);
+    code.push_back({(glm::uint)node_type::OPERATION, op_id});
+    for (size_t g = gates_begin; g < stack.size(); ++g) {
+      code[stack[g].begin].skip = (glm::uint)(code.size() - stack[g].begin - 1);
+    }
+    stack.resize(gates_begin);
+    push_fragment(base, false);
+    return true;
+  }
+};
+
+inline void print_tile_stats(const tile_program_builder &tiles) {
+  const tile_program_builder::stats &s = tiles.last;
+  std::cout << "[TILES] " << tiles.ranges.size() << " tiles of " << TILE_PROGRAM_SIZE << "x"
+            << TILE_PROGRAM_SIZE << ": " << s.pruned << " pruned, " << s.empty << " empty, "
+            << s.full << " whole program, " << s.instructions << " instructions\n";
+}
+
+#endif // TILE_PROGRAMS_H
@@ -2,14 +2,22 @@
 #include "csgrn/compute_shader.hpp"
 #include "csgrn/csg_parser.hpp"
 #include "csgrn/csg_tree.hpp"
+#include "csgrn/mapped_file.hpp"
 #include "csgrn/op_instruction.hpp"
 #include "csgrn/primitive.hpp"
+#include "csgrn/scene_binary.hpp"
+#include "csgrn/renderer.hpp"
+#include "csgrn/cpu_renderer.hpp"
+#include "csgrn/csg_profile.hpp"
+#include "csgrn/headless_context.hpp"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "csgrn/image_io.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <iostream>
 #include <iomanip> // For std::setw
 
-const int LOCAL_SIZE_X = 8;
-const int LOCAL_SIZE_Y = 8;
-
 const int WIDTH = 800;
 const int HEIGHT = 600;
 
@@ -86,29 +94,9 @@ void process_input(GLFWwindow *window)
 
 
 
-// Deletes the entire CSG tree to prevent memory leaks.
-void delete_tree(csg_node* node) {
-    if (!node) return;
-    delete_tree(node->left);
-    delete_tree(node->right);
-    delete node;
-}
-
- std::string readFile(const std::string& filepath) {
-      std::ifstream file(filepath);
-      if (!file.is_open()) {
-        std::cerr << "Error: Could not open file at " << filepath << std::endl;
-        return "";
-      }
-    
-      std::stringstream buffer;
-      buffer << file.rdbuf(); // Read the whole file into the buffer
-      return buffer.str();
-}
-
-void printSSBODebug(const std::vector<instruction>& id_ops, 
-                    const std::vector<primitive>& primitives, 
-                    const std::vector<operation>& operations) {
+void printSSBODebug(std::span<const instruction> id_ops, 
+                    std::span<const primitive> primitives, 
+                    std::span<const operation> operations) {
     
     std::cout << "\n================ SSBO ID_OPS DUMP (RPN ORDER) ================\n";
     std::cout << "| idx | Inst. Type | ID Ref | Detail                       |\n";
@@ -142,12 +130,37 @@ void printSSBODebug(const std::vector<instruction>& id_ops,
             std::string detail = "INVALID ID";
             if (inst.id < operations.size()) {
                 detail = "OP:   " + operation::get_op_name((op_types)operations[inst.id].type);
+                if (operations[inst.id].count > 2) detail += " x" + std::to_string(operations[inst.id].count);
             }
 
             std::cout << " OPERATION  | " << std::setw(6) << inst.id << " | " 
                       << "\033[1;33m" // Yellow color for Ops to stand out
                       << std::left << std::setw(28) << detail << "\033[0m" << std::right << " |";
         }
+        else if (inst.type == (glm::uint)node_type::BOUNDS) {
+            std::string detail = "SKIP " + std::to_string(inst.skip) + " ON MISS";
+            std::cout << " BOUNDS     | " << std::setw(6) << inst.id << " | " 
+                      << std::left << std::setw(28) << detail << std::right << " |";
+        }
+        else if (inst.type == (glm::uint)node_type::SKIP_IF_EMPTY) {
+            std::string detail = "SKIP " + std::to_string(inst.skip) + " IF EMPTY";
+            if (inst.id > 0) detail += ", DROP " + std::to_string(inst.id);
+            std::cout << " SKIP_EMPTY | " << std::setw(6) << "-" << " | " 
+                      << std::left << std::setw(28) << detail << std::right << " |";
+        }
+        else if (inst.type == (glm::uint)node_type::SKIP_IF_BEYOND) {
+            std::string detail = "SKIP " + std::to_string(inst.skip) + " IF BEYOND HIT";
+            std::cout << " SKIP_BEYOND| " << std::setw(6) << inst.id << " | " 
+                      << std::left << std::setw(28) << detail << std::right << " |";
+        }
+        else if (inst.type == (glm::uint)node_type::STORE) {
+            std::cout << " STORE      | " << std::setw(6) << inst.id << " | " 
+                      << std::left << std::setw(28) << "KEEP TOP IN SLOT" << std::right << " |";
+        }
+        else if (inst.type == (glm::uint)node_type::LOAD) {
+            std::cout << " LOAD       | " << std::setw(6) << inst.id << " | " 
+                      << std::left << std::setw(28) << "PUSH SLOT" << std::right << " |";
+        }
         else {
              std::cout << " UNKNOWN    | " << std::setw(6) << inst.id << " | " 
                        << std::setw(28) << "???" << " |";
@@ -157,37 +170,249 @@ void printSSBODebug(const std::vector<instruction>& id_ops,
     std::cout << "==============================================================\n\n";
 }
 
-int main() {
-
-  std::string filepath = "models/wikipedia.csg";
+void print_usage(const char* exe) {
+    std::cout << "Usage:\n"
+              << "  " << exe << " [options] [model.csg | model.csgb]\n"
+              << "  " << exe << " --compile <model.csg> [out.csgb] [--sop]\n"
+              << "  " << exe << " --compile-dir <directory> [threads]\n"
+              << "\nOptions:\n"
+              << "  --headless            render without a window (EGL surfaceless)\n"
+              << "  --cpu                 render on the CPU, no GL needed (implies headless)\n"
+              << "  --threads <N>         CPU renderer threads (default: all cores)\n"
+              << "  --evaluator <mode>    auto, interp, codegen or tiled (default auto)\n"
+              << "  --sop                 compile .csg models to sum-of-products form when they fit\n"
+              << "  --gpu-binning         cull primitives per 8x8 tile in a GPU prepass\n"
+              << "  --stage-program       interpreter reads the program from workgroup shared memory\n"
+              << "  --subgroup-culling    interpreter skips a subtree only when the whole subgroup misses it\n"
+              << "  --subgroup-stats      --subgroup-culling, counting how often the subgroup agrees\n"
+              << "  --size <W>x<H>        output resolution (default " << WIDTH << "x" << HEIGHT << ")\n"
+              << "  --camera <x,y,z[,yaw,pitch]>\n"
+              << "                        camera position and orientation in degrees\n"
+              << "  --frames <N>          frames to render in headless mode (default 1)\n"
+              << "  --output <file>       headless output image, .png or .pfm (default render.png)\n"
+              << "  --profile <out.csgb>  render sample views of a .csg model around the camera,\n"
+              << "                        reorder operands by the measured rates and compile it\n"
+              << "  --profile-views <N>   views rendered by --profile (default 8)\n";
+}
 
-    // 2. Read the file content
-    std::string csgFileContent = readFile(filepath);
+struct app_options {
+  std::string model = "models/wikipedia.csg";
+  bool headless = false;
+  bool cpu = false;
+  unsigned threads = 0;
+  evaluator_mode evaluator = evaluator_mode::automatic;
+  bool sop = false;
+  bool gpu_binning = false;
+  bool staged_program = false;
+  bool subgroup_culling = false;
+  bool subgroup_stats = false;
+  int width = WIDTH;
+  int height = HEIGHT;
+  int frames = 1;
+  std::string output = "render.png";
+  std::string profile_output;
+  int profile_views = 8;
+  glm::vec3 camera_pos = glm::vec3(0.0f, 0.0f, 5.0f);
+  float yaw = YAW;
+  float pitch = PITCH;
+};
 
-    if (csgFileContent.empty()) {
-        return -1; // Exit if file read failed
+// Parses the rendering options. Returns false on malformed input.
+bool parse_options(int argc, char** argv, app_options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+
+    if (arg == "--headless") {
+      opts.headless = true;
+    } else if (arg == "--cpu") {
+      opts.cpu = true;
+      opts.headless = true;
+    } else if (arg == "--sop") {
+      opts.sop = true;
+    } else if (arg == "--gpu-binning") {
+      opts.gpu_binning = true;
+    } else if (arg == "--stage-program") {
+      opts.staged_program = true;
+    } else if (arg == "--subgroup-culling") {
+      opts.subgroup_culling = true;
+    } else if (arg == "--subgroup-stats") {
+      opts.subgroup_culling = true;
+      opts.subgroup_stats = true;
+    } else if (arg == "--threads" && has_value) {
+      opts.threads = (unsigned)std::max(0, std::atoi(argv[++i]));
+    } else if (arg == "--size" && has_value) {
+      if (std::sscanf(argv[++i], "%dx%d", &opts.width, &opts.height) != 2 ||
+          opts.width <= 0 || opts.height <= 0) {
+        std::cerr << "[ERROR] --size expects <W>x<H>, got " << argv[i] << std::endl;
+        return false;
+      }
+    } else if (arg == "--camera" && has_value) {
+      float v[5] = {0.0f, 0.0f, 5.0f, YAW, PITCH};
+      int n = std::sscanf(argv[++i], "%f,%f,%f,%f,%f", &v[0], &v[1], &v[2], &v[3], &v[4]);
+      if (n != 3 && n != 5) {
+        std::cerr << "[ERROR] --camera expects x,y,z[,yaw,pitch], got " << argv[i] << std::endl;
+        return false;
+      }
+      opts.camera_pos = glm::vec3(v[0], v[1], v[2]);
+      opts.yaw = v[3];
+      opts.pitch = v[4];
+    } else if (arg == "--evaluator" && has_value) {
+      std::string mode = argv[++i];
+      if (mode == "auto") opts.evaluator = evaluator_mode::automatic;
+      else if (mode == "interp") opts.evaluator = evaluator_mode::interpreted;
+      else if (mode == "codegen") opts.evaluator = evaluator_mode::generated;
+      else if (mode == "tiled") opts.evaluator = evaluator_mode::tiled;
+      else {
+        std::cerr << "[ERROR] --evaluator expects auto, interp, codegen or tiled, got " << mode << std::endl;
+        return false;
+      }
+    } else if (arg == "--frames" && has_value) {
+      opts.frames = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--output" && has_value) {
+      opts.output = argv[++i];
+    } else if (arg == "--profile" && has_value) {
+      opts.profile_output = argv[++i];
+    } else if (arg == "--profile-views" && has_value) {
+      opts.profile_views = std::max(1, std::atoi(argv[++i]));
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "[ERROR] Unknown or incomplete option " << arg << std::endl;
+      return false;
+    } else {
+      opts.model = arg;
     }
+  }
+  return true;
+}
 
-    // 3. Parse
-    csg_parser parser(csgFileContent);
-    csg_node* root_node = parser.parse();
+// Prints the throughput of an offscreen run and writes its last frame.
+int report_and_write(const char* tag, const std::vector<float>& pixels, double seconds,
+                     const app_options& opts) {
+  double ms_per_frame = seconds * 1000.0 / opts.frames;
+  double mrays = (double)opts.width * opts.height * opts.frames / seconds / 1e6;
+  std::cout << "[" << tag << "] " << opts.frames << " frames at " << opts.width << "x" << opts.height
+            << ": " << ms_per_frame << " ms/frame, " << mrays << " Mrays/s\n";
 
-  if (root_node == nullptr) {
-      std::cout << "Exiting: CSG parsing failed." << std::endl;
-      return -1;
+  if (!write_image(opts.output, pixels, opts.width, opts.height)) {
+    return -1;
   }
-  
-  csg_tree tree(*root_node); // CSGTree constructor takes root by value, works for this test.
+  std::cout << "[" << tag << "] Wrote " << opts.output << "\n";
+  return 0;
+}
 
-  std::vector<primitive> primitives;
-  std::vector<operation> operations;
-  std::vector<instruction> instructions;
+// Renders `frames` frames offscreen, reports the throughput and writes the last
+// frame to opts.output.
+int run_headless(const csg_program_view& scene, const app_options& opts) {
+  headless_context context;
+  if (!context.create(4, 6)) {
+    return -1;
+  }
+
+  if (!gladLoadGLLoader((GLADloadproc)headless_context::get_proc_address)) {
+    std::cerr << "GLAD failed\n";
+    return -1;
+  }
+
+  std::cout << "OpenGL: " << glGetString(GL_VERSION) << " (" << glGetString(GL_RENDERER) << ")\n";
+
+  shader_variant_cache shaders("src/shaders/raytracer.glsl");
+  renderer ray_tracer(shaders, scene, opts.width, opts.height, opts.evaluator, opts.gpu_binning,
+                      opts.staged_program, opts.subgroup_culling, opts.subgroup_stats);
+  glm::mat4 view = camera.get_view_mat();
+
+  // Warm-up frame: shader compilation and buffer uploads are not measured
+  ray_tracer.render(camera.position, view);
+  glFinish();
+
+  auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < opts.frames; ++frame) {
+    ray_tracer.render(camera.position, view);
+  }
+  glFinish();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  ray_tracer.print_subgroup_stats();
+
+  std::vector<float> pixels;
+  ray_tracer.read_pixels(pixels);
+  return report_and_write("HEADLESS", pixels, seconds, opts);
+}
 
-  tree.flatten_tree(root_node, primitives, operations, instructions);
-  printSSBODebug(instructions, primitives, operations);
+// Profiles the model over views orbiting its center, up to 30 degrees either
+// side of the start camera, then writes it compiled with the operand order
+// the profile favours.
+int run_profile(const app_options& opts) {
+  if (std::filesystem::path(opts.model).extension() == ".csgb") {
+    std::cerr << "[ERROR] --profile needs a .csg model, got " << opts.model << std::endl;
+    return -1;
+  }
+  csg_tree tree;
+  if (!load_csg_tree(opts.model, tree)) {
+    return -1;
+  }
+  // Binary operations, so that every intersection and union gets counters
+  csg_program program;
+  tree.flatten_tree(program, false);
 
-  delete_tree(root_node);
+  headless_context context;
+  if (!context.create(4, 6)) {
+    return -1;
+  }
+  if (!gladLoadGLLoader((GLADloadproc)headless_context::get_proc_address)) {
+    std::cerr << "GLAD failed\n";
+    return -1;
+  }
 
+  csg_profile profile;
+  shader_variant_cache shaders("src/shaders/raytracer.glsl");
+  {
+    renderer ray_tracer(shaders, csg_program_view(program), opts.width, opts.height, evaluator_mode::profiled);
+    aabb box = tree.subtree_bounds(tree.root);
+    glm::vec3 center = box.empty() ? glm::vec3(0.0f) : box.center();
+    glm::vec3 up(0.0f, 1.0f, 0.0f);
+    for (int v = 0; v < opts.profile_views; ++v) {
+      if (v == 0) {
+        ray_tracer.render(camera.position, camera.get_view_mat());
+        continue;
+      }
+      float t = opts.profile_views > 2 ? (float)(v - 1) / (opts.profile_views - 2) : 0.5f;
+      float angle = glm::radians(-30.0f + 60.0f * t);
+      glm::vec3 pos = center + glm::vec3(glm::rotate(glm::mat4(1.0f), angle, up) *
+                                         glm::vec4(camera.position - center, 0.0f));
+      ray_tracer.render(pos, glm::lookAt(pos, center, up));
+    }
+    std::vector<glm::uint> counters;
+    ray_tracer.read_profile(counters);
+    profile.accumulate(tree, csg_program_view(program), counters);
+  }
+
+  size_t reordered = profile.reorder(tree);
+  flatten_program(tree, program, CODEGEN_MAX_INSTRUCTIONS);
+  std::cout << "[PROFILE] " << opts.profile_views << " views, operand order set on " << reordered
+            << " operations\n";
+  if (!write_csgb(opts.profile_output, program)) {
+    return -1;
+  }
+  std::cout << "[PROFILE] Wrote " << opts.profile_output << "\n";
+  return 0;
+}
+
+// Renders `frames` frames with the multithreaded CPU renderer.
+int run_cpu(const csg_program_view& scene, const app_options& opts) {
+  cpu_renderer ray_tracer(scene);
+  glm::mat4 view = camera.get_view_mat();
+  std::vector<float> pixels;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < opts.frames; ++frame) {
+    ray_tracer.render(camera.position, view, opts.width, opts.height, pixels, opts.threads);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  return report_and_write("CPU", pixels, seconds, opts);
+}
+
+int run_window(const csg_program_view& scene, const app_options& opts) {
   // INIT GLFW AND OpenGL Context
   if (!glfwInit())
     return -1;
@@ -197,14 +422,14 @@ int main() {
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-  GLFWwindow *win = glfwCreateWindow(WIDTH, HEIGHT, "csgrn", nullptr, nullptr);
+  GLFWwindow *win = glfwCreateWindow(opts.width, opts.height, "csgrn", nullptr, nullptr);
   if (!win) {
     glfwTerminate();
     return -1;
   }
 
-  ctx.width = WIDTH;
-  ctx.height = HEIGHT;
+  ctx.width = opts.width;
+  ctx.height = opts.height;
   ctx.window = win;
 
   glfwMakeContextCurrent(ctx.window);
@@ -223,49 +448,10 @@ int main() {
 
   std::cout << "OpenGL: " << glGetString(GL_VERSION) << "\n";
 
-  compute_shader ray_tracer("src/shaders/raytracer.glsl");
-
-  // Create SSBOs for the flattened CSG tree data
-  unsigned int ssbo_primitives, ssbo_operations, ssbo_id_ops;
-
-
-  
-  // Primitives SSBO
-  glGenBuffers(1, &ssbo_primitives);
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_primitives);
-  glBufferData(GL_SHADER_STORAGE_BUFFER, primitives.size() * sizeof(primitive),
-               primitives.data(), GL_STATIC_DRAW);
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ssbo_primitives);
-
-  // Operations SSBO
-  glGenBuffers(1, &ssbo_operations);
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_operations);
-  glBufferData(GL_SHADER_STORAGE_BUFFER, operations.size() * sizeof(operation),
-               operations.data(), GL_STATIC_DRAW);
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssbo_operations);
-
-  //(Instruction List) SSBO
-  glGenBuffers(1, &ssbo_id_ops);
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_id_ops);
-  glBufferData(GL_SHADER_STORAGE_BUFFER, instructions.size() * sizeof(instruction),
-               instructions.data(), GL_STATIC_DRAW);
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbo_id_ops);
-
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // Unbind
-
-  // Create Texture for output
-  unsigned int textureOut;
-  glGenTextures(1, &textureOut);
-  glActiveTexture(GL_TEXTURE);
-  glBindTexture(GL_TEXTURE_2D, textureOut);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, ctx.width, ctx.height);
-  glBindImageTexture(0, textureOut, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+  {
+  shader_variant_cache shaders("src/shaders/raytracer.glsl");
+  renderer ray_tracer(shaders, scene, ctx.width, ctx.height, opts.evaluator, opts.gpu_binning,
+                      opts.staged_program, opts.subgroup_culling, opts.subgroup_stats);
 
   // QUAD VERTEX DATA
   float quadVertices[] = {
@@ -302,17 +488,7 @@ int main() {
 
     process_input(ctx.window);
 
-    ray_tracer.use();
-
-    // Set camera uniforms
-    glUniform3fv(glGetUniformLocation(ray_tracer.id, "u_camera_pos"), 1, &camera.position[0]);
-    glm::mat4 invView = glm::inverse(camera.get_view_mat());
-    glUniformMatrix4fv(glGetUniformLocation(ray_tracer.id, "u_inv_view"), 1, GL_FALSE, &invView[0][0]);
-
-    glDispatchCompute(ctx.width / LOCAL_SIZE_X, ctx.height / LOCAL_SIZE_Y, 1);
-    glMemoryBarrier(
-        GL_SHADER_IMAGE_ACCESS_BARRIER_BIT); // wait for compute shader to
-                                             // finish writing on the textureOut
+    ray_tracer.render(camera.position, camera.get_view_mat());
 
     glClear(GL_COLOR_BUFFER_BIT);
 
@@ -320,16 +496,111 @@ int main() {
     glBindVertexArray(quadVAO);
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, textureOut);
+    glBindTexture(GL_TEXTURE_2D, ray_tracer.texture_out);
 
-    glDrawArrays(GL_TRIANGLES, 0, 6); // draw the quad with textureOut applied
+    glDrawArrays(GL_TRIANGLES, 0, 6); // draw the quad with texture_out applied
 
     glfwSwapBuffers(ctx.window);
     glfwPollEvents();
   }
+  ray_tracer.print_subgroup_stats();
 
   glDeleteVertexArrays(1, &quadVAO);
   glDeleteBuffers(1, &quadVBO);
+  }
   glfwDestroyWindow(ctx.window);
   glfwTerminate();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+
+  if (argc > 1) {
+    std::string arg = argv[1];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    }
+    if (arg == "--compile") {
+      std::vector<std::string> paths;
+      bool sop = false;
+      for (int i = 2; i < argc; ++i) {
+        if (std::string(argv[i]) == "--sop") sop = true;
+        else paths.push_back(argv[i]);
+      }
+      if (paths.empty()) { print_usage(argv[0]); return -1; }
+      std::filesystem::path out = paths.size() > 1 ? std::filesystem::path(paths[1])
+                                                   : std::filesystem::path(paths[0]).replace_extension(".csgb");
+      return compile_csg(paths[0], out.string(), sop) ? 0 : -1;
+    }
+    if (arg == "--compile-dir") {
+      if (argc < 3) { print_usage(argv[0]); return -1; }
+      int threads = argc > 3 ? std::atoi(argv[3]) : 0;
+      if (argc > 3 && (threads < 0 || std::to_string(threads) != argv[3])) {
+        std::cerr << "[ERROR] --compile-dir expects a thread count, got " << argv[3] << std::endl;
+        print_usage(argv[0]);
+        return -1;
+      }
+      return compile_csg_directory(argv[2], (unsigned)threads) == 0 ? 0 : -1;
+    }
+  }
+
+  app_options opts;
+  if (!parse_options(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+  const std::string& filepath = opts.model;
+
+  class camera start_camera(opts.camera_pos, glm::vec3(0.0f, 1.0f, 0.0f), opts.yaw, opts.pitch);
+  camera = start_camera;
+
+  if (!opts.profile_output.empty()) {
+    return run_profile(opts);
+  }
+
+  // Load the scene: compiled scenes are mapped as-is, text scenes are parsed
+  // and flattened
+  csg_program flattened;
+  csgb_scene compiled;
+  csg_program_view scene;
+
+  if (std::filesystem::path(filepath).extension() == ".csgb") {
+    if (!compiled.load(filepath)) {
+      std::cout << "Exiting: could not load compiled scene." << std::endl;
+      return -1;
+    }
+    scene = compiled.program;
+  } else {
+    // k-way operations only for the consumers that merge them in one sweep
+    size_t k_way_max_instructions = SIZE_MAX;
+    if (!opts.cpu && opts.evaluator == evaluator_mode::automatic) {
+      k_way_max_instructions = CODEGEN_MAX_INSTRUCTIONS;
+    } else if (!opts.cpu && opts.evaluator != evaluator_mode::generated) {
+      k_way_max_instructions = 0;
+    }
+    if (!load_csg(filepath, flattened, opts.sop, k_way_max_instructions)) {
+      std::cout << "Exiting: CSG parsing failed." << std::endl;
+      return -1;
+    }
+    scene = csg_program_view(flattened);
+  }
+
+  printSSBODebug(scene.instructions, scene.primitives, scene.operations);
+  if (!scene.bvh_nodes.empty()) {
+    size_t leaves = std::count_if(scene.bvh_nodes.begin(), scene.bvh_nodes.end(),
+                                  [](const bvh_node &node) { return node.count > 0; });
+    std::cout << "[BVH] " << scene.bvh_nodes.size() << " nodes, " << leaves << " leaves\n";
+  }
+  if (!scene.products.empty()) {
+    std::cout << "[SOP] " << scene.products.size() << " products, " << scene.literals.size() << " literals\n";
+  }
+
+  if (opts.cpu) {
+    return run_cpu(scene, opts);
+  }
+  if (opts.headless) {
+    return run_headless(scene, opts);
+  }
+  return run_window(scene, opts);
 }
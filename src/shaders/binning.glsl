@@ -0,0 +1,77 @@
+#version 460 core
+
+// Binning prepass (see renderer.hpp), run before raytracer.glsl when the view
+// changes. One workgroup per workgroup of the ray tracer's dispatch: it
+// writes the bitmask of the primitives whose world box touches the frustum
+// of that 8x8 pixel tile, and the ray tracer skips the others.
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+// --- Camera Uniforms ---
+uniform vec3 u_camera_pos;
+uniform mat4 u_inv_view;
+uniform ivec2 u_dims; // ray tracer image size
+
+const int TILE_SIZE = 8; // the ray tracer's local size
+
+// std140: two vec4, min.w is 1 for an empty box
+struct bounds {
+  vec4 min;
+  vec4 max;
+};
+
+layout(std140, binding = 11) readonly buffer primitive_bounds_buffer {
+  bounds primitive_boxes[];
+};
+// (primitives + 31) / 32 words per tile, row-major over the workgroups
+// covering the whole image
+layout(std430, binding = 12) writeonly buffer tile_mask_buffer {
+  uint tile_masks[];
+};
+
+// Direction of the ray through pixel p, as in raytracer.glsl's main()
+vec3 pixel_dir(vec2 p) {
+  vec2 uv = p / vec2(u_dims) * 2.0 - 1.0;
+  uv.x *= float(u_dims.x) / float(u_dims.y);
+  vec4 target = u_inv_view * vec4(uv, -1.0, 1.0);
+  return target.xyz / target.w - u_camera_pos;
+}
+
+// Box against the side planes of the frustum, all through the camera. The
+// planes bound a cone in front of it, so boxes behind the camera fail too.
+bool touches(bounds box, vec3 planes[4]) {
+  if (box.min.w != 0.0) return false;
+  for (int k = 0; k < 4; k++) {
+    // Corner furthest along the inward normal
+    vec3 corner = mix(box.min.xyz, box.max.xyz, step(0.0, planes[k]));
+    if (dot(planes[k], corner - u_camera_pos) < 0.0) return false;
+  }
+  return true;
+}
+
+void main() {
+  // Rays start at integer pixel coordinates, so the tile's rays span
+  // [origin, origin + TILE_SIZE - 1]; half a pixel of slack on each side
+  vec2 lo = vec2(gl_WorkGroupID.xy * uint(TILE_SIZE)) - 0.5;
+  vec2 hi = lo + float(TILE_SIZE);
+  vec3 corners[4] = vec3[4](pixel_dir(lo), pixel_dir(vec2(hi.x, lo.y)), pixel_dir(hi),
+                            pixel_dir(vec2(lo.x, hi.y)));
+  vec3 center = pixel_dir((lo + hi) * 0.5);
+
+  vec3 planes[4];
+  for (int k = 0; k < 4; k++) {
+    vec3 n = cross(corners[k], corners[(k + 1) % 4]);
+    planes[k] = dot(n, center) < 0.0 ? -n : n;
+  }
+
+  uint count = uint(primitive_boxes.length());
+  uint words = (count + 31u) / 32u;
+  uint tile = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+  for (uint w = gl_LocalInvocationIndex; w < words; w += gl_WorkGroupSize.x) {
+    uint mask = 0u;
+    for (uint b = 0u; b < 32u; b++) {
+      uint id = w * 32u + b;
+      if (id < count && touches(primitive_boxes[id], planes)) mask |= 1u << b;
+    }
+    tile_masks[tile * words + w] = mask;
+  }
+}
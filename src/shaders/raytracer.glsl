@@ -1,5 +1,15 @@
 #version 460 core
 
+// Subgroup culling variant, only defined by the host when the driver has
+// GL_KHR_shader_subgroup with votes in compute shaders (see renderer.hpp)
+#ifdef SUBGROUP_CULLING
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_vote : require
+#endif
+#ifdef SUBGROUP_STATS
+#extension GL_KHR_shader_subgroup_arithmetic : require
+#endif
+
 // ENUMS AS CONSTS
 const uint PRIMITIVE_TYPE_PRIMITIVENONE = 0;
 const uint PRIMITIVE_TYPE_SPHERE = 1;
@@ -10,9 +20,16 @@ const uint OP_TYPE_OPNONE = 0;
 const uint OP_TYPE_OPUNION = 1;
 const uint OP_TYPE_OPINTERSECTION = 2;
 const uint OP_TYPE_OPDIFFERENCE = 4;
+const uint OP_TYPE_OPREVERSEDIFFERENCE = 8; // op2 - op1, see operations.hpp
+const int MAX_OPERANDS = 8; // largest operation::count
 
 const uint ID_OP_TYPE_PRIMITIVE = 0;
 const uint ID_OP_TYPE_OPERATION = 1;
+const uint ID_OP_TYPE_BOUNDS = 2;
+const uint ID_OP_TYPE_STORE = 3;
+const uint ID_OP_TYPE_LOAD = 4;
+const uint ID_OP_TYPE_SKIP_IF_EMPTY = 5;
+const uint ID_OP_TYPE_SKIP_IF_BEYOND = 6;
 
 // WORKGROUP LOCAL SIZES
 layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
@@ -21,6 +38,11 @@ layout(rgba32f, binding = 0) uniform image2D img_output;
 // --- Camera Uniforms ---
 uniform vec3 u_camera_pos;
 uniform mat4 u_inv_view;
+// The dispatch only covers the workgroups the scene can reach (see
+// renderer.hpp): pixel of its first invocation, a multiple of the local size
+uniform ivec2 u_pixel_offset;
+
+ivec2 invocation_pixel() { return ivec2(gl_GlobalInvocationID.xy) + u_pixel_offset; }
 
 struct material {
   vec4 albedo;
@@ -35,20 +57,45 @@ struct primitive {
     uint type;       
     material material; 
     mat4 transform;  
+    mat4 inv_transform;
+    mat4 normal_matrix;
 };
 
 struct operation {
   uint type;
   uint operand1;
   uint operand2;
-  uint padding;
+  uint count; // operands popped, 2 unless a k-way union or intersection
 };
 
 struct instruction {
     uint type; 
     uint id;
-    uint padding1;
-    uint padding2;
+    uint skip;      // BOUNDS: length of the guarded subtree
+    uint padding;
+};
+
+// Top-level BVH over the root union (bvh.hpp). Interior nodes have count == 0
+// and children at first and first + 1; leaves run instructions[first, first + count).
+struct bvh_node {
+  vec3 min;
+  uint first;
+  vec3 max;
+  uint count;
+};
+
+// World-space box of a subtree; min.w != 0 marks an empty box
+struct bounds {
+  vec4 min;
+  vec4 max;
+};
+
+// Sum-of-products form (csg_sop.hpp): a product covers literals[first, first + count)
+struct sop_product {
+  vec3 min;
+  uint first;
+  vec3 max;
+  uint count;
 };
 
 struct ray {
@@ -66,22 +113,143 @@ layout(std140, binding = 2) readonly buffer operation_buffer {
 layout(std140, binding = 3) readonly buffer instructions_buffer {
   instruction instructions[];
 };
+// u_camera_pos in each primitive's object space, refreshed by the CPU every frame
+layout(std140, binding = 4) readonly buffer local_origin_buffer {
+  vec4 local_origins[];
+};
+layout(std140, binding = 5) readonly buffer bounds_buffer {
+  bounds node_bounds[];
+};
+// Empty when the scene has no top-level BVH
+layout(std140, binding = 6) readonly buffer bvh_buffer {
+  bvh_node bvh_nodes[];
+};
+// Empty unless the scene is in sum-of-products form. A literal is a
+// primitive index << 1, with the low bit set when negated.
+layout(std140, binding = 8) readonly buffer sop_product_buffer {
+  sop_product sop_products[];
+};
+layout(std430, binding = 9) readonly buffer sop_literal_buffer {
+  uint sop_literals[];
+};
+
+// Tile programs (see tile_programs.hpp): the instruction range each
+// TILE_SIZE square tile of the image runs, rebuilt when the camera moves.
+// An empty range is background. first == TILE_FULL_PROGRAM runs the whole
+// scene, whose instructions end at `end`.
+#ifdef TILE_PROGRAMS
+layout(std430, binding = 10) readonly buffer tile_buffer {
+  uvec2 tile_ranges[];
+};
+uniform uint u_tiles_x;
+const uint TILE_FULL_PROGRAM = 0xFFFFFFFFu;
+#endif
+
+// Binning variant: bitmask of the primitives whose box touches this
+// workgroup's frustum, (primitives + 31) / 32 words per workgroup, written by
+// the prepass in binning.glsl
+#ifdef GPU_BINNING
+layout(std430, binding = 12) readonly buffer tile_mask_buffer {
+  uint tile_masks[];
+};
+
+bool primitive_binned(uint id) {
+  uint words = (uint(primitives.length()) + 31u) / 32u;
+  // Masks are laid out over the workgroups of the whole image
+  uvec2 group = uvec2(invocation_pixel()) / gl_WorkGroupSize.xy;
+  uint groups_x = (uint(imageSize(img_output).x) + gl_WorkGroupSize.x - 1u) / gl_WorkGroupSize.x;
+  uint tile = group.y * groups_x + group.x;
+  return (tile_masks[tile * words + (id >> 5)] & (1u << (id & 31u))) != 0u;
+}
+#endif
+
+// Profiling variant (see csg_profile.hpp): two counters per instruction,
+// executions and outcomes. The outcome is a non-empty result for PRIMITIVE
+// and OPERATION, a taken skip for SKIP_IF_EMPTY and SKIP_IF_BEYOND.
+#ifdef CSGRN_PROFILE
+layout(std430, binding = 7) buffer profile_buffer {
+  uint profile_counts[];
+};
+#define PROFILE_EXECUTED(i) atomicAdd(profile_counts[2 * (i)], 1u)
+#define PROFILE_OUTCOME(i) atomicAdd(profile_counts[2 * (i) + 1], 1u)
+#else
+#define PROFILE_EXECUTED(i)
+#define PROFILE_OUTCOME(i)
+#endif
+
+// Subgroup culling: a bound test skips only when it does for every active
+// lane of the subgroup, so the lanes keep running the same instructions
+// instead of diverging. A lane that missed a box another lane hit runs the
+// subtree along and clears its result at the end. With SUBGROUP_STATS,
+// counters of bound tests per subgroup, tests skipped by the whole subgroup
+// and lanes that ran along are kept per invocation and flushed once.
+#ifdef SUBGROUP_STATS
+layout(std430, binding = 13) buffer subgroup_count_buffer {
+  uint subgroup_counts[3];
+};
+uvec3 subgroup_tally = uvec3(0u);
+
+// One atomic per counter and subgroup, once the scene is evaluated
+void flush_subgroup_stats() {
+  uvec3 total = subgroupAdd(subgroup_tally);
+  if (subgroupElect()) {
+    atomicAdd(subgroup_counts[0], total.x);
+    atomicAdd(subgroup_counts[1], total.y);
+    atomicAdd(subgroup_counts[2], total.z);
+  }
+}
+#else
+void flush_subgroup_stats() {}
+#endif
+
+#ifdef SUBGROUP_CULLING
+bool coherent_skip(bool skip) {
+  bool all_skip = subgroupAll(skip);
+#ifdef SUBGROUP_STATS
+  if (subgroupElect()) subgroup_tally += uvec3(1u, all_skip ? 1u : 0u, 0u);
+  if (skip && !all_skip) subgroup_tally.z++;
+#endif
+  return all_skip;
+}
+#else
+bool coherent_skip(bool skip) { return skip; }
+#endif
 
 //If t_min > t_max, there is no intersection.
 const vec2 NO_HIT_SPAN = vec2(1.0/0.0, -1.0/0.0); // (inf, -inf)
 
+// Sized per scene by the host (see program_limits.hpp); defaults for a bare compile
+#ifndef MAX_SPANS
 #define MAX_SPANS 8
-
+#endif
+#ifndef STACK_SIZE
+#define STACK_SIZE 16
+#endif
+// BVH_MAX_DEPTH in bvh.hpp plus the far children pushed on the way down
+#define BVH_STACK_SIZE 32
+
+// Packed span (span.hpp): entry and exit distances, and the primitive whose
+// surface starts the span << 1, with the low bit set when its normal is flipped
 struct span {
     vec2 interval;
-    uint primitive_id;
-    bool invert_normal;
+    uint id;
 };
 
-struct interval_list {
-    span spans[MAX_SPANS];
-    int count;
-};
+// Interval lists live in one flat pool of private memory: list L owns
+// pool[L * MAX_SPANS, (L + 1) * MAX_SPANS). Lists 0..STACK_SIZE are the RPN
+// stack plus a spare that receives each merge, STACK_SIZE + 1 accumulates
+// BVH leaves, and the STORE/LOAD slots follow. Results are written in place
+// instead of copying whole lists in and out of functions.
+#ifndef SOP_LITERALS
+#ifdef SHARED_SLOTS
+#define POOL_LISTS (STACK_SIZE + 2 + SHARED_SLOTS)
+#else
+#define POOL_LISTS (STACK_SIZE + 2)
+#endif
+#define SLOT_LIST(k) (STACK_SIZE + 2 + (k))
+span pool[POOL_LISTS * MAX_SPANS];
+int pool_count[POOL_LISTS];
+#endif
 
 // --- CSG & Intersection functions ---
 vec2 intersect_unit_sphere(ray r) {
@@ -155,6 +323,7 @@ vec2 intersect_cylinder(ray r) {
     return vec2(t_enter, t_exit);
 }
 
+#ifndef SOP_LITERALS
 bool is_inside(int op, bool in_a, bool in_b) {
     if (op == OP_TYPE_OPUNION)        return in_a || in_b;
     if (op == OP_TYPE_OPINTERSECTION) return in_a && in_b;
@@ -162,107 +331,154 @@ bool is_inside(int op, bool in_a, bool in_b) {
     return false;
 }
 
-interval_list merge_spans(interval_list l_a, interval_list l_b, int op){
-  interval_list result;
-  result.count = 0;
+// Boolean `op` of lists a and b, written into list dst (neither a nor b)
+void merge_into(int dst, int a, int b, int op) {
+  int count_a = pool_count[a];
+  int count_b = pool_count[b];
+  int base_a = a * MAX_SPANS;
+  int base_b = b * MAX_SPANS;
+  int base_dst = dst * MAX_SPANS;
+  int n = 0;
 
   int i = 0;
   int j = 0;
-  bool in_a, in_b = false;
+  bool in_a = false;
+  bool in_b = false;
   bool last_in_result = false;
 
   float t_start = 0.0;
-  uint  start_prim_id = 0;
-  bool  start_inverted = false;
-
-  while((i < l_a.count || j < l_b.count) && result.count < MAX_SPANS) {
-    float t_a = 0.0;
-    float t_b = 0.0;
-
-    if(i < l_a.count) {
-      if(in_a){
-        t_a = l_a.spans[i].interval.y; // if inside take the end of the interval.
-      }else {
-        t_a = l_a.spans[i].interval.x;
-      }
-    }else{
-      t_a = 1.0/0.0; // INF
-    }
+  uint start_id = 0;
+  // Leaving the subtrahend shows its surface from the inside
+  uint b_flip = op == OP_TYPE_OPDIFFERENCE ? 1u : 0u;
 
-    if(j < l_b.count) {
-      if(in_b){
-        t_b = l_b.spans[j].interval.y; // if inside take the end of the interval.
-      }else {
-        t_b = l_b.spans[j].interval.x;
-      }
-    }else{
-      t_b = 1.0/0.0; // INF
-    }
-
-    float current_t;
-    uint current_prim;
-    bool current_invert;
+  while ((i < count_a || j < count_b) && n < MAX_SPANS) {
+    float t_a = 1.0 / 0.0; // INF
+    float t_b = 1.0 / 0.0;
+    if (i < count_a) t_a = in_a ? pool[base_a + i].interval.y : pool[base_a + i].interval.x;
+    if (j < count_b) t_b = in_b ? pool[base_b + j].interval.y : pool[base_b + j].interval.x;
 
     // Pick the closest point
+    float current_t;
+    uint current_id;
     if (t_a < t_b) {
       current_t = t_a;
-      current_prim = l_a.spans[i].primitive_id;
-      // Inherit inversion (if A was already inverted)
-      current_invert = l_a.spans[i].invert_normal; 
-      // Toggle state
+      current_id = pool[base_a + i].id;
       in_a = !in_a;
-            
-      // exited from A -> move to next A span index
-      if (!in_a) i++; 
+      if (!in_a) i++; // exited from A -> move to next A span index
     } else {
       current_t = t_b;
-      current_prim = l_b.spans[j].primitive_id;
-            
-      bool is_difference_operand = (op == OP_TYPE_OPDIFFERENCE);
-      current_invert = is_difference_operand ? !l_b.spans[j].invert_normal : l_b.spans[j].invert_normal;
-
-      // Toggle state
+      current_id = pool[base_b + j].id ^ b_flip;
       in_b = !in_b;
-      if (!in_b) j++; 
+      if (!in_b) j++;
     }
 
     bool in_result = is_inside(op, in_a, in_b);
+    if (in_result != last_in_result) {
+      if (in_result) {
+        t_start = current_t;
+        start_id = current_id;
+      } else if (current_t > t_start + 0.0001) {
+        pool[base_dst + n] = span(vec2(t_start, current_t), start_id);
+        n++;
+      }
+      last_in_result = in_result;
+    }
+  }
+  pool_count[dst] = n;
+}
+
+// Union or intersection of lists[0, k) into list dst in one sweep, counting
+// how many operands the ray is inside. Called by the generated evaluator,
+// where k is a constant; the interpreter folds k-way operations into
+// merge_into() calls instead, since a sweep over a dynamic k keeps its
+// cursors in dynamically indexed private memory.
+void merge_many(int dst, int lists[MAX_OPERANDS], int k, int op) {
+  int next[MAX_OPERANDS];
+  for (int j = 0; j < k; j++) next[j] = 0;
+  uint inside = 0u;
+  int covered = 0;
+  int needed = op == OP_TYPE_OPINTERSECTION ? k : 1;
+  int base_dst = dst * MAX_SPANS;
+  int n = 0;
+
+  bool last_in_result = false;
+  float t_start = 0.0;
+  uint start_id = 0;
+
+  while (n < MAX_SPANS) {
+    // Pick the closest point over all operands
+    int pick = -1;
+    float current_t = 1.0 / 0.0;
+    for (int j = 0; j < k; j++) {
+      if (next[j] >= pool_count[lists[j]]) continue;
+      vec2 s = pool[lists[j] * MAX_SPANS + next[j]].interval;
+      float t = (inside & (1u << j)) != 0u ? s.y : s.x;
+      if (pick < 0 || t < current_t) {
+        pick = j;
+        current_t = t;
+      }
+    }
+    if (pick < 0) break;
 
+    uint current_id = pool[lists[pick] * MAX_SPANS + next[pick]].id;
+    inside ^= 1u << pick;
+    if ((inside & (1u << pick)) != 0u) {
+      covered++;
+    } else {
+      covered--;
+      next[pick]++;
+    }
+
+    bool in_result = covered >= needed;
     if (in_result != last_in_result) {
-        if (in_result) {
-                t_start = current_t;
-                start_prim_id = current_prim;
-                start_inverted = current_invert;
-        } else {
-          if (current_t > t_start + 0.0001) {
-            int idx = result.count;
-            result.spans[idx].interval = vec2(t_start, current_t);
-            result.spans[idx].primitive_id = start_prim_id;
-            result.spans[idx].invert_normal = start_inverted;
-
-            result.count++;
-          }
-        }
+      if (in_result) {
+        t_start = current_t;
+        start_id = current_id;
+      } else if (current_t > t_start + 0.0001) {
+        pool[base_dst + n] = span(vec2(t_start, current_t), start_id);
+        n++;
+      }
       last_in_result = in_result;
     }
   }
+  pool_count[dst] = n;
+}
 
-  return result;
+// One span for a primitive hit, none on a miss
+void set_primitive(int list, vec2 hit, uint id) {
+  if (hit.x >= hit.y) {
+    pool_count[list] = 0; // Miss
+  } else {
+    pool_count[list] = 1;
+    pool[list * MAX_SPANS] = span(hit, id << 1);
+  }
 }
 
-interval_list make_primitive_interval(vec2 span, uint id) {
-    interval_list list;
-    if (span.x >= span.y) {
-        list.count = 0; // Miss
-    } else {
-        list.count = 1;
-        list.spans[0].interval = span;
-        list.spans[0].primitive_id = id;
-        list.spans[0].invert_normal = false; // Default
+void copy_list(int dst, int src) {
+  for (int k = 0; k < pool_count[src]; k++) pool[dst * MAX_SPANS + k] = pool[src * MAX_SPANS + k];
+  pool_count[dst] = pool_count[src];
+}
+
+// First span the shading would pick
+bool first_visible_span(int list, out span hit) {
+  for (int k = 0; k < pool_count[list]; k++) {
+    if (pool[list * MAX_SPANS + k].interval.x > 0.001) {
+      hit = pool[list * MAX_SPANS + k];
+      return true;
     }
-    return list;
+  }
+  return false;
 }
 
+// Entry of the first visible span, infinity if none
+float first_visible_entry(int list) {
+  for (int k = 0; k < pool_count[list]; k++) {
+    if (pool[list * MAX_SPANS + k].interval.x > 0.001) return pool[list * MAX_SPANS + k].interval.x;
+  }
+  return 1.0 / 0.0;
+}
+#endif
+
 vec3 get_local_normal(uint type, vec3 p) {
     if (type == PRIMITIVE_TYPE_SPHERE) {
         // For a unit sphere at (0,0,0), normal is just the point itself
@@ -292,13 +508,432 @@ vec3 get_local_normal(uint type, vec3 p) {
     return vec3(0.0, 1.0, 0.0); // Default fallback
 }
 
+// Slab test against a subtree's box: true if the ray touches it at some t >= 0
+bool hit_bounds(ray r, vec3 inv_dir, bounds b) {
+  if (b.min.w != 0.0) return false;
+
+  vec3 t0 = (b.min.xyz - r.origin) * inv_dir;
+  vec3 t1 = (b.max.xyz - r.origin) * inv_dir;
+  vec3 tmin = min(t0, t1);
+  vec3 tmax = max(t0, t1);
+  float t_enter = max(max(tmin.x, tmin.y), tmin.z);
+  float t_exit = min(min(tmax.x, tmax.y), tmax.z);
+  return t_enter <= t_exit && t_exit >= 0.0;
+}
+
+// Entry distance into a subtree's box, infinity on a miss
+float bounds_entry(ray r, vec3 inv_dir, bounds b) {
+  if (b.min.w != 0.0) return 1.0 / 0.0;
+
+  vec3 t0 = (b.min.xyz - r.origin) * inv_dir;
+  vec3 t1 = (b.max.xyz - r.origin) * inv_dir;
+  vec3 tmin = min(t0, t1);
+  vec3 tmax = max(t0, t1);
+  float t_enter = max(max(tmin.x, tmin.y), tmin.z);
+  float t_exit = min(min(tmax.x, tmax.y), tmax.z);
+  return (t_enter > t_exit || t_exit < 0.0) ? 1.0 / 0.0 : t_enter;
+}
+
+bool hit_bounds(ray r, vec3 inv_dir, uint id) { return hit_bounds(r, inv_dir, node_bounds[id]); }
+float bounds_entry(ray r, vec3 inv_dir, uint id) { return bounds_entry(r, inv_dir, node_bounds[id]); }
+
+// Ray in the object space of primitive `id`. The origin is precomputed per frame.
+ray to_object_space(uint id, ray r) {
+  ray transformed_ray;
+  transformed_ray.origin = local_origins[id].xyz;
+  transformed_ray.dir = (primitives[id].inv_transform * vec4(r.dir, 0.0)).xyz;
+  return transformed_ray;
+}
+
+// Span of a unit primitive of `type` along an object-space ray
+vec2 intersect_object_space(uint type, ray transformed_ray) {
+  if (type == PRIMITIVE_TYPE_SPHERE) return intersect_unit_sphere(transformed_ray);
+  if (type == PRIMITIVE_TYPE_CUBE) return intersect_box_AABB(transformed_ray);
+  if (type == PRIMITIVE_TYPE_CYLINDER) return intersect_cylinder(transformed_ray);
+  return NO_HIT_SPAN;
+}
+
+// Object-space span of primitive `id` along the ray
+vec2 intersect_primitive(uint id, ray r) {
+#ifdef GPU_BINNING
+  // No ray of this workgroup can reach it in front of the camera
+  if (!primitive_binned(id)) return NO_HIT_SPAN;
+#endif
+  return intersect_object_space(primitives[id].type, to_object_space(id, r));
+}
+
+// Straight-line evaluator generated from the scene (glsl_codegen.hpp), if any.
+// It defines CSGRN_GENERATED_EVALUATOR and its own evaluate_scene().
+// @inject
+
+#ifdef SOP_LITERALS
+// Entry distance into product `id`'s box, infinity on a miss
+float product_entry(ray r, vec3 inv_dir, uint id) {
+  vec3 t0 = (sop_products[id].min - r.origin) * inv_dir;
+  vec3 t1 = (sop_products[id].max - r.origin) * inv_dir;
+  vec3 tmin = min(t0, t1);
+  vec3 tmax = max(t0, t1);
+  float t_enter = max(max(tmin.x, tmin.y), tmin.z);
+  float t_exit = min(min(tmax.x, tmax.y), tmax.z);
+  return (t_enter > t_exit || t_exit < 0.0) ? 1.0 / 0.0 : t_enter;
+}
+
+// Sum-of-products evaluator. Every primitive is convex, so a product is the
+// span [enter, exit) shared by its positive literals minus the spans of its
+// negated ones, and its visible surface starts either at that entry or where
+// the ray leaves a negated primitive. Each of those candidates is classified
+// against the negated spans and only the nearest hit over all products is
+// kept: no interval list is ever merged. The result is that single hit.
+bool evaluate_scene(ray r, out span hit) {
+  vec3 inv_dir = 1.0 / r.dir;
+  vec2 spans[SOP_LITERALS];
+  float t_best = 1.0 / 0.0;
+  uint best_id = 0;
+  bool best_inverted = false;
+
+  for (uint p = 0; p < sop_products.length(); p++) {
+    if (product_entry(r, inv_dir, p) > t_best) continue;
+    uint first = sop_products[p].first;
+    uint count = sop_products[p].count;
+
+    float t_enter = -1.0 / 0.0;
+    float t_exit = 1.0 / 0.0;
+    uint enter_id = 0;
+    for (uint k = 0; k < count; k++) {
+      uint literal = sop_literals[first + k];
+      spans[k] = intersect_primitive(literal >> 1, r);
+      if ((literal & 1u) == 0u) {
+        if (spans[k].x > t_enter) { t_enter = spans[k].x; enter_id = literal >> 1; }
+        t_exit = min(t_exit, spans[k].y);
+      }
+    }
+    if (!(t_enter < t_exit)) continue; // a positive literal is missed
+
+    // Candidate k < count is the exit of negated literal k, count the entry
+    for (uint c = 0; c <= count; c++) {
+      float t = t_enter;
+      uint id = enter_id;
+      if (c < count) {
+        uint literal = sop_literals[first + c];
+        if ((literal & 1u) == 0u || spans[c].x >= spans[c].y) continue;
+        t = spans[c].y;
+        id = literal >> 1;
+      }
+      if (t <= 0.001 || t >= t_best || t < t_enter || t >= t_exit) continue;
+
+      bool removed = false;
+      for (uint k = 0; k < count && !removed; k++) {
+        removed = (sop_literals[first + k] & 1u) != 0u && spans[k].x <= t && t < spans[k].y;
+      }
+      if (!removed) {
+        t_best = t;
+        best_id = id;
+        best_inverted = c < count; // seen from inside the removed primitive
+      }
+    }
+  }
+
+  if (isinf(t_best)) return false;
+  // Only the entry is known
+  hit = span(vec2(t_best, 1.0 / 0.0), best_id << 1 | (best_inverted ? 1u : 0u));
+  return true;
+}
+#endif
+
+#if !defined(CSGRN_GENERATED_EVALUATOR) && !defined(SOP_LITERALS)
+// Pool list of each stack position, and the free list receiving the next
+// merge. A merge writes into the spare, which then takes its first operand's
+// place, so stack entries are never copied.
+int list_at[STACK_SIZE];
+int spare_list;
+
+#ifdef STAGED_PROGRAM
+// Staged variant: the workgroup copies a chunk of the program, with the
+// records each instruction reads, into shared memory once, and every
+// invocation runs its own instructions of the chunk from there. The chunk
+// loop holds barriers, so all invocations of a workgroup must run the same
+// range: the host only enables it without a BVH (see renderer.hpp), and tile
+// programs are shared by whole workgroups.
+const uint STAGE_CHUNK = gl_WorkGroupSize.x * gl_WorkGroupSize.y;
+
+struct staged_instruction {
+  instruction inst;
+  operation op;   // OPERATION: the operation. PRIMITIVE: type is the primitive's
+  bounds box;     // BOUNDS, SKIP_IF_BEYOND: the subtree's box. PRIMITIVE: min is the local origin
+  mat3 dir_xform; // PRIMITIVE: world to object space for directions
+};
+
+shared staged_instruction staged[STAGE_CHUNK];
+// Earliest instruction still needed by an invocation, alternating between
+// two counters so one can be reset while the other is still being read
+shared uint staged_next[2];
+uint staged_parity = 0u;
+uint staged_base; // first instruction of the staged chunk
+
+// Stages instructions[base, min(base + STAGE_CHUNK, end)), one per
+// invocation. Returns the end of the chunk.
+uint stage_chunk(uint base, uint end) {
+  uint k = gl_LocalInvocationIndex;
+  if (base + k < end) {
+    instruction inst = instructions[base + k];
+    staged[k].inst = inst;
+    if (inst.type == ID_OP_TYPE_PRIMITIVE) {
+      staged[k].op.type = primitives[inst.id].type;
+      staged[k].box.min = local_origins[inst.id];
+      staged[k].dir_xform = mat3(primitives[inst.id].inv_transform);
+    } else if (inst.type == ID_OP_TYPE_OPERATION) {
+      staged[k].op = operations[inst.id];
+    } else if (inst.type == ID_OP_TYPE_BOUNDS || inst.type == ID_OP_TYPE_SKIP_IF_BEYOND) {
+      staged[k].box = node_bounds[inst.id];
+    }
+  }
+  if (k == 0u) staged_next[staged_parity] = end;
+  staged_base = base;
+  memoryBarrierShared();
+  barrier();
+  return min(base + STAGE_CHUNK, end);
+}
+
+// Start of the next chunk once every invocation has left this one at its
+// instruction `i`: chunks that all of them skip are never staged
+uint next_chunk(uint i) {
+  atomicMin(staged_next[staged_parity], i);
+  memoryBarrierShared();
+  barrier();
+  uint next = staged_next[staged_parity];
+  staged_parity ^= 1u;
+  return next;
+}
+
+instruction program_instruction(uint i) { return staged[i - staged_base].inst; }
+
+vec2 program_primitive_span(uint i, instruction inst, ray r) {
+#ifdef GPU_BINNING
+  if (!primitive_binned(inst.id)) return NO_HIT_SPAN;
+#endif
+  uint k = i - staged_base;
+  ray transformed_ray;
+  transformed_ray.origin = staged[k].box.min.xyz;
+  transformed_ray.dir = staged[k].dir_xform * r.dir;
+  return intersect_object_space(staged[k].op.type, transformed_ray);
+}
+
+operation program_operation(uint i, instruction inst) { return staged[i - staged_base].op; }
+bounds program_bounds(uint i, instruction inst) { return staged[i - staged_base].box; }
+#else
+// The whole range is one chunk read straight from the SSBOs
+uint stage_chunk(uint base, uint end) { return end; }
+uint next_chunk(uint i) { return i; }
+
+instruction program_instruction(uint i) { return instructions[i]; }
+vec2 program_primitive_span(uint i, instruction inst, ray r) { return intersect_primitive(inst.id, r); }
+operation program_operation(uint i, instruction inst) { return operations[inst.id]; }
+bounds program_bounds(uint i, instruction inst) { return node_bounds[inst.id]; }
+#endif
+
+// Generic interpreter: runs instructions[first, end) on the pool stack.
+// Returns the list holding the result, -1 when the range leaves nothing on
+// the stack.
+int evaluate_range(ray r, vec3 inv_dir, uint first, uint end) {
+  int sp = 0;
+  uint i = first;
+#ifdef SUBGROUP_CULLING
+  uint clear_at = 0xFFFFFFFFu; // end of the missed subtree this lane runs along
+#endif
+
+  for (uint chunk = first; chunk < end; chunk = next_chunk(i)) {
+    uint chunk_end = stage_chunk(chunk, end);
+    for (; i < chunk_end; i++) {
+#ifdef SUBGROUP_CULLING
+        if (i == clear_at) {
+            pool_count[list_at[sp - 1]] = 0;
+            clear_at = 0xFFFFFFFFu;
+        }
+#endif
+        instruction inst = program_instruction(i);
+        PROFILE_EXECUTED(i);
+        if (inst.type == ID_OP_TYPE_PRIMITIVE) {
+            set_primitive(list_at[sp++], program_primitive_span(i, inst, r), inst.id);
+#ifdef CSGRN_PROFILE
+            if (pool_count[list_at[sp - 1]] > 0) PROFILE_OUTCOME(i);
+#endif
+
+        } else if (inst.type == ID_OP_TYPE_OPERATION) {
+            // MERGE THE TOP op.count LISTS INTO THE SPARE
+            operation op = program_operation(i, inst);
+            sp -= int(op.count) - 1;
+            int op1 = list_at[sp - 1];
+
+            // A k-way union or intersection folds its operands left to right
+            for (int k = 1; k < int(op.count) - 1; k++) {
+                merge_into(spare_list, op1, list_at[sp - 1 + k], int(op.type));
+                list_at[sp - 1] = spare_list;
+                spare_list = op1;
+                op1 = list_at[sp - 1];
+            }
+            int last = list_at[sp + int(op.count) - 2];
+            if (op.type == OP_TYPE_OPREVERSEDIFFERENCE) {
+                merge_into(spare_list, last, op1, int(OP_TYPE_OPDIFFERENCE));
+            } else {
+                merge_into(spare_list, op1, last, int(op.type));
+            }
+            list_at[sp - 1] = spare_list;
+            spare_list = op1;
+#ifdef CSGRN_PROFILE
+            if (pool_count[list_at[sp - 1]] > 0) PROFILE_OUTCOME(i);
+#endif
+        } else if (inst.type == ID_OP_TYPE_BOUNDS) {
+            // Ray misses the subtree's box: its result is empty, skip it
+            bool miss = !hit_bounds(r, inv_dir, program_bounds(i, inst));
+            if (coherent_skip(miss)) {
+                pool_count[list_at[sp++]] = 0;
+                i += inst.skip;
+            }
+#ifdef SUBGROUP_CULLING
+            else if (miss && clear_at == 0xFFFFFFFFu) {
+                clear_at = i + inst.skip + 1u;
+            }
+#endif
+        } else if (inst.type == ID_OP_TYPE_SKIP_IF_EMPTY) {
+            // Empty minuend or intersection operand: the result stays empty
+            if (pool_count[list_at[sp - 1]] == 0) {
+                PROFILE_OUTCOME(i);
+                sp -= int(inst.id); // operands of a k-way intersection pushed so far
+                pool_count[list_at[sp - 1]] = 0;
+                i += inst.skip;
+            }
+        } else if (inst.type == ID_OP_TYPE_SKIP_IF_BEYOND) {
+            // Union operand starting past the closest hit cannot change it.
+            // Running it anyway leaves the first visible span as it is.
+            if (coherent_skip(bounds_entry(r, inv_dir, program_bounds(i, inst)) >
+                              first_visible_entry(list_at[sp - 1]))) {
+                PROFILE_OUTCOME(i);
+                i += inst.skip;
+            }
+        }
+#ifdef SHARED_SLOTS
+        else if (inst.type == ID_OP_TYPE_STORE) {
+            copy_list(SLOT_LIST(int(inst.id)), list_at[sp - 1]);
+        } else if (inst.type == ID_OP_TYPE_LOAD) {
+            copy_list(list_at[sp++], SLOT_LIST(int(inst.id)));
+        }
+#endif
+    }
+  }
+#ifdef SUBGROUP_CULLING
+  if (i == clear_at) pool_count[list_at[sp - 1]] = 0;
+#endif
+
+  return sp == 0 ? -1 : list_at[0]; // The result of the whole tree
+}
+
+// Entry distance of the ray into BVH node `id`, infinity on a miss
+float bvh_entry(ray r, vec3 inv_dir, uint id) {
+  vec3 t0 = (bvh_nodes[id].min - r.origin) * inv_dir;
+  vec3 t1 = (bvh_nodes[id].max - r.origin) * inv_dir;
+  vec3 tmin = min(t0, t1);
+  vec3 tmax = max(t0, t1);
+  float t_enter = max(max(tmin.x, tmin.y), tmin.z);
+  float t_exit = min(min(tmax.x, tmax.y), tmax.z);
+  return (t_enter > t_exit || t_exit < 0.0) ? 1.0 / 0.0 : t_enter;
+}
+
+// Visits the BVH leaves front to back, unioning their results. A node whose
+// box starts behind the current first hit cannot change it and is skipped.
+// Returns the list holding the union.
+int traverse_bvh(ray r, vec3 inv_dir) {
+  int acc = STACK_SIZE + 1;
+  pool_count[acc] = 0;
+  float t_best = 1.0 / 0.0;
+
+  uint nodes[BVH_STACK_SIZE];
+  float entries[BVH_STACK_SIZE];
+  int sp = 0;
+
+  float t_root = bvh_entry(r, inv_dir, 0);
+  if (!isinf(t_root)) {
+    nodes[0] = 0;
+    entries[0] = t_root;
+    sp = 1;
+  }
+
+  while (sp > 0) {
+    sp--;
+    if (entries[sp] > t_best) continue;
+    bvh_node node = bvh_nodes[nodes[sp]];
+
+    if (node.count > 0) {
+      int leaf = evaluate_range(r, inv_dir, node.first, node.first + node.count);
+      if (leaf >= 0) {
+        merge_into(spare_list, acc, leaf, int(OP_TYPE_OPUNION));
+        int merged = spare_list;
+        spare_list = acc;
+        acc = merged;
+        t_best = first_visible_entry(acc);
+      }
+      continue;
+    }
+
+    uint near_id = node.first;
+    uint far_id = node.first + 1;
+    float t_near = bvh_entry(r, inv_dir, near_id);
+    float t_far = bvh_entry(r, inv_dir, far_id);
+    if (t_far < t_near) {
+      uint tmp_id = near_id; near_id = far_id; far_id = tmp_id;
+      float tmp_t = t_near; t_near = t_far; t_far = tmp_t;
+    }
+    // Far child first so the near one is popped next
+    if (!isinf(t_far) && t_far <= t_best && sp < BVH_STACK_SIZE) {
+      nodes[sp] = far_id;
+      entries[sp++] = t_far;
+    }
+    if (!isinf(t_near) && t_near <= t_best && sp < BVH_STACK_SIZE) {
+      nodes[sp] = near_id;
+      entries[sp++] = t_near;
+    }
+  }
+  return acc;
+}
+
+// First visible span of the scene. Returns false when nothing is hit.
+bool evaluate_scene(ray r, out span hit) {
+  vec3 inv_dir = 1.0 / r.dir;
+  for (int k = 0; k < STACK_SIZE; k++) list_at[k] = k;
+  spare_list = STACK_SIZE;
+  uint scene_end = uint(instructions.length());
+
+#ifdef TILE_PROGRAMS
+  uvec2 tile = uvec2(invocation_pixel()) / uint(TILE_SIZE);
+  uvec2 range = tile_ranges[tile.y * u_tiles_x + tile.x];
+  if (range.x != TILE_FULL_PROGRAM) {
+    int tile_list = range.x == range.y ? -1 : evaluate_range(r, inv_dir, range.x, range.y);
+    return tile_list >= 0 && first_visible_span(tile_list, hit);
+  }
+  scene_end = range.y; // the tile streams follow the scene's instructions
+#endif
+
+  int list;
+  if (bvh_nodes.length() == 0) {
+    list = evaluate_range(r, inv_dir, 0, scene_end);
+  } else {
+    list = traverse_bvh(r, inv_dir);
+  }
+  return list >= 0 && first_visible_span(list, hit);
+}
+#endif
+
 void main() {
-  ivec2 pixel_coords = ivec2(gl_GlobalInvocationID.xy);
+  ivec2 pixel_coords = invocation_pixel();
   ivec2 dims = imageSize(img_output);
 
-  if (pixel_coords.x >= dims.x || pixel_coords.y >= dims.y) {
+  // With STAGED_PROGRAM, invocations past the edge still take part in the
+  // workgroup's barriers and only skip the store
+  bool inside = pixel_coords.x < dims.x && pixel_coords.y < dims.y;
+#ifndef STAGED_PROGRAM
+  if (!inside) {
     return;
   }
+#endif
 
   // --- Ray Generation ---
   vec2 uv = vec2(pixel_coords) / vec2(dims);
@@ -316,89 +951,35 @@ void main() {
   vec4 world_space_target = u_inv_view * view_space_target;
   r.dir = normalize(world_space_target.xyz / world_space_target.w - r.origin);
 
-  interval_list stack[16];
-  int sp = 0;
+  span hit;
+  bool has_result = evaluate_scene(r, hit);
+  flush_subgroup_stats();
 
-  uint num_id_ops = instructions.length();
-  for (uint i = 0; i < num_id_ops; i++) {
-      instruction inst = instructions[i];
-      if (inst.type == ID_OP_TYPE_PRIMITIVE) {
-          primitive p = primitives[inst.id];
-          
-          // Transform ray into primitive's object space
-          mat4 inv_transform = inverse(p.transform);
-
-          ray transformed_ray;
-          transformed_ray.origin = (inv_transform * vec4(r.origin, 1.0)).xyz;
-          transformed_ray.dir = (inv_transform * vec4(r.dir, 0.0)).xyz;
-
-          vec2 hit_span = NO_HIT_SPAN;
-          if (p.type == PRIMITIVE_TYPE_SPHERE) {
-              hit_span = intersect_unit_sphere(transformed_ray);
-          }
-          else if (p.type == PRIMITIVE_TYPE_CUBE) {  
-              hit_span = intersect_box_AABB(transformed_ray);
-          }
-          else if(p.type == PRIMITIVE_TYPE_CYLINDER){  
-              hit_span = intersect_cylinder(transformed_ray);
-          }
-          
-          stack[sp++] = make_primitive_interval(hit_span, inst.id);
-
-      } else if (inst.type == ID_OP_TYPE_OPERATION) {
-          // CALCULATE BRANCH SPANS
-          interval_list op2 = stack[--sp];
-          interval_list op1 = stack[--sp];
-          operation op = operations[inst.id];
-     
-          // MERGE THEM
-          stack[sp++] = merge_spans(op1, op2, int(op.type));
-      }
-  }
+if (has_result) {
+        float t_closest = hit.interval.x;
+        primitive prim = primitives[hit.id >> 1];
 
+        vec3 world_pos = r.origin + r.dir * t_closest;
 
-if (sp > 0) {
-        interval_list final_list = stack[0]; // The result of the whole tree
+        vec3 local_pos = (prim.inv_transform * vec4(world_pos, 1.0)).xyz;
 
-        float t_closest = 1.0 / 0.0; // Infinity
-        int best_idx = -1;
+        vec3 local_normal = get_local_normal(prim.type, local_pos);
 
-        for (int k = 0; k < final_list.count; k++) {
-            float t_enter = final_list.spans[k].interval.x;
-            if (t_enter > 0.001 && t_enter < t_closest) {
-                t_closest = t_enter;
-                best_idx = k;
-            }
-        }
+        vec3 world_normal = normalize(mat3(prim.normal_matrix) * local_normal);
 
-        if (best_idx != -1) {
-            span hit = final_list.spans[best_idx];
-            primitive prim = primitives[hit.primitive_id];
-
-            vec3 world_pos = r.origin + r.dir * t_closest;
-
-            mat4 inv_mat = inverse(prim.transform);
-            vec3 local_pos = (inv_mat * vec4(world_pos, 1.0)).xyz;
-
-            vec3 local_normal = get_local_normal(prim.type, local_pos);
-
-            mat3 normal_matrix = transpose(inverse(mat3(prim.transform)));
-            vec3 world_normal = normalize(normal_matrix * local_normal);
-
-            if (hit.invert_normal) {
-                world_normal = -world_normal;
-            }
+        if ((hit.id & 1u) != 0u) {
+            world_normal = -world_normal;
+        }
 
-            float ambient = 0.2;
-            float diffuse = max(0.0, dot(world_normal, light_dir));
-            
-            vec3 view_dir = normalize(u_camera_pos - world_pos);
-            vec3 reflect_dir = reflect(-light_dir, world_normal);
-            float spec = pow(max(dot(view_dir, reflect_dir), 0.0), 32.0) * prim.material.spec;
-            vec3 albedo = prim.material.albedo.rgb;
+        float ambient = 0.2;
+        float diffuse = max(0.0, dot(world_normal, light_dir));
+        
+        vec3 view_dir = normalize(u_camera_pos - world_pos);
+        vec3 reflect_dir = reflect(-light_dir, world_normal);
+        float spec = pow(max(dot(view_dir, reflect_dir), 0.0), 32.0) * prim.material.spec;
+        vec3 albedo = prim.material.albedo.rgb;
 
-            color = albedo * (ambient + diffuse) + vec3(spec);
-        }
+        color = albedo * (ambient + diffuse) + vec3(spec);
     }
-    imageStore(img_output, pixel_coords, vec4(color, 1.0));
+    if (inside) imageStore(img_output, pixel_coords, vec4(color, 1.0));
 }
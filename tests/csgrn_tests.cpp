@@ -0,0 +1,227 @@
+// Regression tests for the compile passes, CPU only. Every models/ scene is
+// rendered from the parsed tree as it is, then after simplification, k-way
+// flattening and per-tile pruning, and the images must match. Unit checks
+// cover the empty-set and Boolean identities of the parser and simplifier
+// and the operand order chosen from profile counters.
+#include "csgrn/cpu_renderer.hpp"
+#include "csgrn/csg_parser.hpp"
+#include "csgrn/csg_profile.hpp"
+#include "csgrn/csg_simplify.hpp"
+#include "csgrn/mapped_file.hpp"
+#include "csgrn/tile_programs.hpp"
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <glm/gtc/matrix_transform.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr int WIDTH = 192;
+constexpr int HEIGHT = 144;
+// Pixels allowed to differ, for ties between coincident surfaces
+constexpr double MAX_BAD_FRACTION = 0.002;
+const glm::vec3 BACKGROUND(0.5f, 0.7f, 1.0f); // sky of cpu_renderer::shade_pixel()
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "[FAIL] " << what << std::endl;
+    failures++;
+  }
+}
+
+csg_tree parse(std::string_view text) {
+  csg_parser parser(text);
+  return parser.parse();
+}
+
+const char *const SHIFTED_CUBE = "multmatrix([[1,0,0,5],[0,1,0,0],[0,0,1,0],[0,0,0,1]]) { cube(size=[1,1,1]); }";
+
+void test_parser_folds() {
+  // An empty operand is the empty set, not a missing one
+  check(parse("difference() { union() {} sphere(r=1); }").empty(), "parser: 0 - A = 0");
+  check(parse("intersection() { sphere(r=1); union() {} }").empty(), "parser: A * 0 = 0");
+  csg_tree tree = parse("difference() { sphere(r=1); union() {} }");
+  check(!tree.empty() && tree[tree.root].is_leave(), "parser: A - 0 = A");
+  tree = parse("union() { union() {} sphere(r=1); }");
+  check(!tree.empty() && tree[tree.root].is_leave(), "parser: A + 0 = A");
+
+  // An unsupported statement is skipped whole, not taken as the empty set
+  tree = parse("intersection() { translate([1,0,0]) sphere(r=1); sphere(r=1); cube(size=[1,1,1]); }");
+  check(!tree.empty() && tree[tree.root].op == op_types::op_intersection, "parser: unsupported statement");
+  tree = parse("difference() { linear_extrude(height=1) { square(1); } sphere(r=1); cube(size=[1,1,1]); }");
+  check(!tree.empty() && tree[tree.root].op == op_types::op_difference, "parser: unsupported block");
+
+  // multmatrix() and color() blocks are implicit unions
+  tree = parse("color([1,0,0,1]) { sphere(r=1); cube(size=[1,1,1]); }");
+  check(!tree.empty() && tree[tree.root].op == op_types::op_union, "parser: color() with two children");
+  tree = parse(std::string("multmatrix([[1,0,0,0],[0,1,0,0],[0,0,1,0],[0,0,0,1]]) { sphere(r=1); ") +
+               SHIFTED_CUBE + " }");
+  check(!tree.empty() && tree[tree.root].op == op_types::op_union, "parser: multmatrix() with two children");
+}
+
+void test_simplifier_folds() {
+  struct fold_case {
+    std::string scene;
+    bool empty;           // simplified tree is empty
+    size_t distinct;      // primitives left
+    size_t pruned, folded;
+    const char *name;
+  };
+  const std::string disjoint = std::string("intersection() { cube(size=[1,1,1]); ") + SHIFTED_CUBE + " }";
+  const fold_case cases[] = {
+      {"union() { sphere(r=1); sphere(r=1); }", false, 1, 0, 0, "A + A = A"},
+      {"intersection() { sphere(r=1); sphere(r=1); }", false, 1, 0, 0, "A * A = A"},
+      {"difference() { sphere(r=1); sphere(r=1); }", true, 0, 0, 2, "A - A = 0"},
+      {"intersection() { sphere(r=1); union() { sphere(r=1); cube(size=[1,1,1]); } }", false, 1, 0, 0,
+       "A * (A + B) = A"},
+      {"difference() { " + disjoint + " sphere(r=1); }", true, 0, 2, 1, "0 - A = 0"},
+      {"intersection() { difference() { sphere(r=1); sphere(r=1); } cube(size=[1,1,1]); }", true, 0, 0, 3,
+       "A * 0 = 0"},
+      {"union() { " + disjoint + " sphere(r=1); }", false, 1, 2, 0, "disjoint intersection"},
+  };
+  for (const fold_case &c : cases) {
+    csg_tree tree = parse(c.scene);
+    csg_simplifier simplifier;
+    csg_tree out = simplifier.simplify(tree);
+    const csg_simplifier::stats &s = simplifier.last;
+    check(out.empty() == c.empty && s.primitives_out == c.distinct && s.pruned == c.pruned &&
+              s.folded == c.folded,
+          std::string("simplify: ") + c.name + " (distinct " + std::to_string(s.primitives_out) +
+              ", pruned " + std::to_string(s.pruned) + ", folded " + std::to_string(s.folded) + ")");
+  }
+}
+
+// Counters of a profiled render of a 3-operand intersection whose cube is
+// always empty: the cube must become the first operand of its intersection.
+void test_profile_reorder() {
+  csg_tree tree = parse("intersection() { cube(size=[1,1,1]); sphere(r=1); cylinder(h=2, r1=1, r2=1); }");
+  csg_program program;
+  tree.flatten_tree(program, false); // as run_profile() does
+  std::vector<glm::uint> counters(2 * program.instructions.size(), 100);
+  node_id cube = null_node;
+  for (const csg_tree::node_range &range : tree.node_ranges) {
+    if (tree[range.node].primitive != primitive_types::cube) continue;
+    cube = range.node;
+    for (glm::uint i = range.begin; i < range.end; ++i) counters[2 * i + 1] = 0;
+  }
+  csg_profile profile;
+  profile.accumulate(tree, program, counters);
+  size_t reordered = profile.reorder(tree);
+  bool cube_first = false;
+  for (node_id id = 0; id < tree.nodes.size(); ++id) {
+    const csg_node &node = tree[id];
+    if (!node.is_leave() && (node.left == cube || node.right == cube)) cube_first = tree.first_operand[id] == cube;
+  }
+  check(cube != null_node && reordered > 0 && cube_first, "profile: 3-operand intersection reordered");
+}
+
+std::vector<float> render(const csg_program_view &program, const glm::vec3 &eye, const glm::mat4 &view) {
+  std::vector<float> rgba;
+  cpu_renderer(program).render(eye, view, WIDTH, HEIGHT, rgba);
+  return rgba;
+}
+
+// Every tile rendered from its own pruned stream, as the tiled evaluator does
+std::vector<float> render_tiled(const csg_program_view &program, const glm::vec3 &eye, const glm::mat4 &view) {
+  tile_program_builder tiles(program, compute_program_limits(program));
+  tiles.build(view, WIDTH, HEIGHT);
+  std::vector<float> out((size_t)WIDTH * HEIGHT * 4);
+  for (int ty = 0; ty < tiles.tiles_y; ++ty) {
+    for (int tx = 0; tx < tiles.tiles_x; ++tx) {
+      tile_range range = tiles.ranges[(size_t)ty * tiles.tiles_x + tx];
+      csg_program_view stream = program;
+      if (range.first != TILE_FULL_PROGRAM) {
+        stream.instructions = std::span<const instruction>(tiles.instructions).subspan(range.first, range.end - range.first);
+        stream.operations = tiles.operations;
+        stream.node_bounds = tiles.node_bounds;
+        stream.bvh_nodes = {};
+      }
+      std::vector<float> image = render(stream, eye, view);
+      for (int y = ty * TILE_PROGRAM_SIZE; y < std::min((ty + 1) * TILE_PROGRAM_SIZE, HEIGHT); ++y) {
+        size_t row = ((size_t)y * WIDTH + tx * TILE_PROGRAM_SIZE) * 4;
+        size_t width = std::min(TILE_PROGRAM_SIZE, WIDTH - tx * TILE_PROGRAM_SIZE);
+        std::copy_n(image.begin() + row, width * 4, out.begin() + row);
+      }
+    }
+  }
+  return out;
+}
+
+void compare(const std::vector<float> &expected, const std::vector<float> &actual, const std::string &what) {
+  size_t bad = 0;
+  for (size_t px = 0; px < expected.size(); px += 4) {
+    for (size_t c = 0; c < 3; ++c) {
+      if (std::abs(expected[px + c] - actual[px + c]) > 1e-3f) {
+        bad++;
+        break;
+      }
+    }
+  }
+  size_t pixels = expected.size() / 4;
+  check(bad <= pixels * MAX_BAD_FRACTION, what + ": " + std::to_string(bad) + " of " + std::to_string(pixels) +
+                                               " pixels differ");
+}
+
+void test_model(const std::filesystem::path &path) {
+  mapped_file file(path.string());
+  csg_tree parsed = parse(file.view());
+  std::string name = path.filename().string();
+  if (parsed.empty()) {
+    check(false, name + ": parsing failed");
+    return;
+  }
+
+  // Camera looking at the scene from the front, above and to the right
+  aabb box = parsed.subtree_bounds(parsed.root);
+  glm::vec3 center = box.center();
+  float radius = std::max(glm::length(box.max - box.min) * 0.5f, 0.1f);
+  glm::vec3 eye = center + glm::normalize(glm::vec3(0.6f, 0.5f, 1.0f)) * radius * 3.0f;
+  glm::mat4 view = glm::lookAt(eye, center, glm::vec3(0.0f, 1.0f, 0.0f));
+
+  csg_program reference;
+  parsed.flatten_tree(reference, false);
+  std::vector<float> expected = render(reference, eye, view);
+  bool visible = false;
+  for (size_t px = 0; px < expected.size() && !visible; px += 4) {
+    visible = glm::vec3(expected[px], expected[px + 1], expected[px + 2]) != BACKGROUND;
+  }
+  check(visible, name + ": nothing visible from the test camera");
+
+  csg_simplifier simplifier;
+  csg_tree simplified = simplifier.simplify(parsed);
+  csg_program k_way, binary;
+  simplified.flatten_tree(k_way, true);
+  simplified.flatten_tree(binary, false);
+
+  compare(expected, render(k_way, eye, view), name + ": simplified, k-way");
+  compare(expected, render(binary, eye, view), name + ": simplified, binary");
+  compare(expected, render_tiled(binary, eye, view), name + ": tile programs");
+}
+
+} // namespace
+
+int main() {
+  test_parser_folds();
+  test_simplifier_folds();
+  test_profile_reorder();
+
+  std::vector<std::filesystem::path> models;
+  for (const auto &entry : std::filesystem::directory_iterator(CSGRN_SOURCE_DIR "/models")) {
+    if (entry.path().extension() == ".csg") models.push_back(entry.path());
+  }
+  std::sort(models.begin(), models.end());
+  check(!models.empty(), "no models found");
+  for (const auto &path : models) test_model(path);
+
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed (" << models.size() << " models)" << std::endl;
+  return 0;
+}